@@ -2,11 +2,48 @@
 #include <sstream>
 #include <iostream>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <cctype>
+#include <climits>
+
 #include <string>
 #include <deque>
 #include <vector>
+#include <map>
 #include <memory>
+#include <functional>
 #include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef MK_PARSER_GMK
+extern "C" {
+#include <gnumake.h>
+}
+#endif
 
 template <typename T>
 std::string join(const T &v, const std::string &delim) {
@@ -21,6 +58,232 @@ std::string join(const T &v, const std::string &delim) {
     return s;
 }
 
+/*
+ * Where code generation writes to. Nodes append to it in place instead of
+ * building and returning strings.
+ */
+class Output
+{
+    public:
+        virtual ~Output();
+
+        virtual void write(const char *data, size_t size) = 0;
+
+        Output &operator<<(const std::string &s);
+
+        template <size_t N>
+        Output &operator<<(const char (&s)[N]);
+};
+
+Output::~Output()
+{
+}
+
+Output &Output::operator<<(const std::string &s)
+{
+    write(s.data(), s.size());
+    return *this;
+}
+
+template <size_t N>
+Output &Output::operator<<(const char (&s)[N])
+{
+    write(s, N - 1);
+    return *this;
+}
+
+template <typename T>
+void join(Output &out, const T &v, const std::string &delim) {
+    for (const auto &i : v) {
+        if (&i != &v[0]) {
+            out << delim;
+        }
+        out << i;
+    }
+}
+
+/*
+ * Output kept in fixed size chunks, so growing it never moves what was
+ * already written. iov() hands the chunks to writev() as they are.
+ */
+class Buffer : public Output
+{
+    public:
+        void write(const char *data, size_t size);
+
+        size_t size() const;
+        std::string str() const;
+        std::vector<iovec> iov() const;
+    private:
+        static const size_t _chunkSize = 16384;
+
+        std::vector<std::string> _chunks;
+        size_t                   _size = 0;
+};
+
+void Buffer::write(const char *data, size_t size)
+{
+    _size += size;
+    while (size) {
+        if (_chunks.empty() || _chunks.back().size() == _chunkSize) {
+            _chunks.emplace_back();
+            _chunks.back().reserve(_chunkSize);
+        }
+
+        auto &chunk = _chunks.back();
+        auto count = std::min(size, _chunkSize - chunk.size());
+        chunk.append(data, count);
+
+        data += count;
+        size -= count;
+    }
+}
+
+size_t Buffer::size() const
+{
+    return _size;
+}
+
+std::string Buffer::str() const
+{
+    std::string s;
+    s.reserve(_size);
+    for (const auto &chunk : _chunks)
+        s += chunk;
+
+    return s;
+}
+
+std::vector<iovec> Buffer::iov() const
+{
+    std::vector<iovec> iov;
+    for (const auto &chunk : _chunks)
+        iov.push_back({ const_cast<char *>(chunk.data()), chunk.size() });
+
+    return iov;
+}
+
+/*
+ * FNV-1a, chained through seed so several inputs can be folded together.
+ */
+uint64_t hashString(const std::string &s,
+                    uint64_t seed = 14695981039346656037ULL)
+{
+    for (auto c : s) {
+        seed ^= static_cast<unsigned char>(c);
+        seed *= 1099511628211ULL;
+    }
+
+    return seed;
+}
+
+std::string readFile(const std::string &file)
+{
+    std::ifstream is(file);
+    std::stringstream content;
+    content << is.rdbuf();
+
+    return content.str();
+}
+
+/*
+ * writev() until everything is written, skipping the first done bytes.
+ */
+bool writeAll(int fd, std::vector<iovec> data, size_t done = 0)
+{
+    size_t i = 0;
+    for (bool first = true; i < data.size(); first = false) {
+        size_t count = done;
+        if (!first) {
+            auto written = writev(fd, &data[i],
+                                  std::min<size_t>(data.size() - i, IOV_MAX));
+            if (written < 0)
+                return false;
+
+            count = written;
+        }
+
+        for (; i < data.size() && count >= data[i].iov_len; ++i)
+            count -= data[i].iov_len;
+
+        if (count > 0) {
+            data[i].iov_base = static_cast<char *>(data[i].iov_base) + count;
+            data[i].iov_len -= count;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Writes through a temporary file renamed over the target, so readers never
+ * see a partially written file.
+ */
+bool writeFile(const std::string &file, const std::vector<iovec> &data)
+{
+    auto temp = file + ".tmp." + std::to_string(getpid());
+
+    auto fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0644);
+    if (fd < 0)
+        return false;
+
+    bool ok = writeAll(fd, data);
+
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(temp.c_str(), file.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool writeFile(const std::string &file, const std::string &data)
+{
+    return writeFile(file, { { const_cast<char *>(data.data()),
+                               data.size() } });
+}
+
+std::string replaceAll(std::string s, const std::string &from,
+                       const std::string &to)
+{
+    if (from.empty())
+        return s;
+
+    for (auto pos = s.find(from); pos != std::string::npos;
+         pos = s.find(from, pos + to.size()))
+        s.replace(pos, from.size(), to);
+
+    return s;
+}
+
+/*
+ * path made absolute against dir, without . and .. components or repeated
+ * slashes.
+ */
+std::string absolutePath(const std::string &path, const std::string &dir)
+{
+    std::vector<std::string> parts;
+    std::istringstream components(path[0] == '/' ? path : dir + "/" + path);
+    for (std::string part; std::getline(components, part, '/');) {
+        if (part == "..") {
+            if (!parts.empty())
+                parts.pop_back();
+        }
+        else if (!part.empty() && part != ".")
+            parts.push_back(part);
+    }
+
+    return "/" + join(parts, "/");
+}
+
+std::string currentDir()
+{
+    char dir[PATH_MAX];
+    return getcwd(dir, sizeof(dir)) ? dir : "/";
+}
+
 //TODO: Write the .h files!!
 
 class _Exception : public std::exception
@@ -45,6 +308,83 @@ const char *_Exception::what() const throw()
 #define Exception(value) _Exception("LINE=" + std::to_string(__LINE__) + " " \
                                     + value)
 
+/*
+ * Part of the manifest and output cache keys, so it has to change along with
+ * anything generated from an unchanged .mk, or older outputs are kept.
+ */
+#define MK_PARSER_VERSION "1.4.0"
+
+/*
+ * Whether file holds exactly data: sizes first, then a streaming compare.
+ */
+bool sameContent(const std::string &file, const std::vector<iovec> &data)
+{
+    size_t size = 0;
+    for (const auto &chunk : data)
+        size += chunk.iov_len;
+
+    struct stat st;
+    if (stat(file.c_str(), &st) == 0 && size_t(st.st_size) == size) {
+        std::ifstream is(file, std::ios::binary);
+
+        char buffer[65536];
+        size_t chunk = 0;
+        size_t offset = 0;
+        size_t compared = 0;
+        bool same = true;
+        while (same && is && compared < size) {
+            is.read(buffer, sizeof(buffer));
+            size_t count = is.gcount();
+            for (size_t i = 0; same && i < count;) {
+                if (chunk == data.size()) {
+                    same = false;
+                    break;
+                }
+
+                auto base = static_cast<const char *>(data[chunk].iov_base);
+                auto length = std::min(count - i,
+                                       data[chunk].iov_len - offset);
+                same = memcmp(buffer + i, base + offset, length) == 0;
+
+                i += length;
+                offset += length;
+                compared += length;
+                if (offset == data[chunk].iov_len) {
+                    ++chunk;
+                    offset = 0;
+                }
+            }
+        }
+
+        return same && compared == size;
+    }
+
+    return false;
+}
+
+/*
+ * Leaves the file (and its mtime) alone when it already holds data, so make
+ * and automake don't see regenerated but identical files as out of date.
+ * Returns whether the file was written.
+ */
+bool writeFileIfChanged(const std::string &file,
+                        const std::vector<iovec> &data)
+{
+    if (sameContent(file, data))
+        return false;
+
+    if (!writeFile(file, data))
+        throw Exception("Can't write " + file);
+
+    return true;
+}
+
+bool writeFileIfChanged(const std::string &file, const std::string &data)
+{
+    return writeFileIfChanged(file, { { const_cast<char *>(data.data()),
+                                        data.size() } });
+}
+
 class Token
 {
     public:
@@ -87,13 +427,72 @@ class ExtAST
     public:
         virtual ~ExtAST();
 
-        virtual std::string codeGen() const = 0;
+        virtual void codeGen(Output &out) const = 0;
+
+        /*
+         * Whether codeGen() only writes to out and looks libraries up, so
+         * it can run next to other nodes on another thread.
+         */
+        virtual bool independent() const;
+
+        /*
+         * Whether the node compiles sources into objects of its own that
+         * could come from a convenience library instead, giving them with
+         * what they're compiled against, see BlockAST::shareSources().
+         */
+        virtual bool compiles(std::vector<std::string> *sources,
+                              std::vector<std::string> *dependencies,
+                              std::vector<std::string> *unityExclude) const;
+
+        /*
+         * The name the node registered with BlockAST::registerTarget(), if
+         * any.
+         */
+        virtual std::string target() const;
+
+        /*
+         * Adds the .mk files of the sub makes the node generates to files.
+         */
+        virtual void subMakes(std::vector<std::string> *files) const;
+
+        /*
+         * Adds the set_compile_option options of the sources to options.
+         */
+        virtual void
+        compileOptions(std::map<std::string,
+                                std::vector<std::string>> *options) const;
 };
 
 ExtAST::~ExtAST()
 {
 }
 
+bool ExtAST::independent() const
+{
+    return true;
+}
+
+bool ExtAST::compiles(std::vector<std::string> *,
+                      std::vector<std::string> *,
+                      std::vector<std::string> *) const
+{
+    return false;
+}
+
+std::string ExtAST::target() const
+{
+    return "";
+}
+
+void ExtAST::subMakes(std::vector<std::string> *) const
+{
+}
+
+void ExtAST::compileOptions(std::map<std::string,
+                                     std::vector<std::string>> *) const
+{
+}
+
 class AttributeAST : public ExtAST
 {
     public:
@@ -115,7 +514,7 @@ class AttributeAST : public ExtAST
         std::string _key;
         std::vector<std::string> _value;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
 };
 
 AttributeAST::Type AttributeAST::type() const
@@ -138,9 +537,8 @@ void AttributeAST::appendValues(const std::vector<std::string> &values)
     _value.insert(_value.end(), values.begin(), values.end());
 }
 
-std::string AttributeAST::codeGen() const
+void AttributeAST::codeGen(Output &) const
 {
-    return "";
 }
 
 class BlockAST : public ExtAST
@@ -150,6 +548,176 @@ class BlockAST : public ExtAST
         std::unordered_map<std::string, std::pair<std::string, std::string>>
         _libraryMap;
 
+        static const
+        std::unordered_map<std::string, std::pair<std::string, std::string>>
+        _builtinLibraryMap;
+
+        struct Target
+        {
+            std::string              name;
+            std::string              type;
+            std::string              file;
+            std::vector<std::string> sources;
+            std::vector<std::string> dependencies;
+        };
+
+        static std::unordered_map<std::string, Target> _targets;
+
+        /*
+         * The targets (or TYPE=type for all targets of a type, tests for
+         * all the test types) a build is for. Other targets are left out,
+         * or put in `if _prunedIf`, unless they link into one of them.
+         */
+        static std::vector<std::string>        _roots;
+        static std::unordered_set<std::string> _needed;
+        static std::string                     _prunedIf;
+
+        static void findNeeded();
+        static void nodeGen(const ExtAST &node, Output &out);
+
+        static std::vector<std::string>
+        impactedTests(const std::string &top,
+                      const std::vector<std::string> &files);
+
+        static unsigned _jobs;
+
+        static std::vector<std::string> functions();
+
+        /*
+         * Directory of the .mk being generated, relative to the top level
+         * one, when everything goes to a single Makefile.am. Empty
+         * otherwise.
+         */
+        static std::string _prefix;
+
+        static std::string path(const std::string &name);
+        static std::string variable(const std::string &name);
+        static void pathsGen(Output &out,
+                             const std::vector<std::string> &names);
+
+        /*
+         * What the all and check phony targets of a build.ninja depend on.
+         */
+        struct Goals
+        {
+            std::vector<std::string> all;
+            std::vector<std::string> check;
+        };
+
+        static Goals *_goals;
+
+        static void buildGoal(const std::string &path);
+        static void checkGoal(const std::string &path);
+
+        static std::string ninjaVariables(const std::string &value);
+
+        static void
+        ninjaDependencies(const std::vector<std::string> &dependencies,
+                          std::vector<std::string> *inputs,
+                          std::vector<std::string> *libs,
+                          std::vector<std::string> *cxxFlags);
+
+        static std::vector<std::string>
+        ninjaObjectsGen(Output &out, const std::string &target,
+                        const std::vector<std::string> &sources,
+                        const std::vector<std::string> &cxxFlags,
+                        const std::vector<std::string> *unityExclude
+                            = nullptr);
+
+        static void
+        ninjaLinkGen(Output &out, const std::string &rule,
+                     const std::string &output,
+                     const std::vector<std::string> &objects,
+                     const std::vector<std::string> &inputs,
+                     const std::vector<std::string> &libs,
+                     const std::string &rpath);
+
+        static std::string ninjaRpath(const std::string &dir);
+
+        /*
+         * Maximum number of sources per generated amalgamation in unity
+         * builds, 0 when they are off.
+         */
+        static size_t _unitySize;
+
+        static std::vector<std::vector<std::string>>
+        unityGroups(const std::vector<std::string> &sources,
+                    const std::vector<std::string> &exclude,
+                    std::vector<std::string> *separate);
+
+        static void sourcesGen(Output &out, const std::string &variable,
+                               const std::string &stem,
+                               const std::vector<std::string> &sources,
+                               const std::vector<std::string> &unityExclude);
+
+        /*
+         * Whether programs and libraries get a precompiled header: the one
+         * declared with NAME_PCH or, with _inferPch, one made of the most
+         * common includes of their sources.
+         */
+        static bool _pch;
+        static bool _inferPch;
+
+        static bool pchGen(Output &out, const std::string &variable,
+                           const std::string &stem,
+                           const std::vector<std::string> &sources,
+                           const std::string &header,
+                           const std::vector<std::string> &flags,
+                           std::vector<std::string> *cxxFlags);
+
+        /*
+         * Sources compiled by several programs and libraries of a .mk with
+         * the same flags are built once, in convenience libraries the
+         * targets link instead. What each target gives up and links, for
+         * the .mk being generated.
+         */
+        struct SharedSources
+        {
+            std::vector<std::string> sources;
+            std::vector<std::string> libraries;
+        };
+
+        /*
+         * What the .mk being generated decided for its targets as a whole:
+         * the shared sources, and the compile options of each source.
+         */
+        struct Shared
+        {
+            std::unordered_map<const ExtAST *, SharedSources> targets;
+            std::map<std::string, std::vector<std::string>>   options;
+        };
+
+        static bool         _shareSources;
+        static const Shared *_shared;
+
+        /*
+         * Addons are listed in NODEJS_ADDONS, apart from the convenience
+         * libraries next to them in noinst_LTLIBRARIES.
+         */
+        static bool         _addonList;
+
+        static const SharedSources *sharedSources(const ExtAST *node);
+
+        /*
+         * Sources with compile options of their own, grouped by options.
+         */
+        typedef std::vector<std::pair<std::vector<std::string>,
+                                      std::vector<std::string>>> OptionGroups;
+
+        static const std::vector<std::string> *
+        sourceOptions(const std::string &source);
+
+        static OptionGroups optionGroups(std::vector<std::string> *sources,
+                                         std::vector<std::string> *options);
+
+        static void optionsGen(Output &out, const std::string &stem,
+                               const OptionGroups &groups,
+                               const std::vector<std::string> &cxxFlags);
+
+        static void ownOptionsGen(Output &out, const std::string &variable,
+                                  const std::vector<std::string> &options,
+                                  std::vector<std::string> *cxxFlags);
+
         typedef
         std::unordered_map<std::string,
                            std::shared_ptr<AttributeAST>> Attributes;
@@ -229,13 +797,90 @@ class BlockAST : public ExtAST
         parsePythonTest(const Attributes &attributes, const std::string &file,
                         std::deque<Token> *tokens);
 
-        std::string codeGen() const;
+        static const std::pair<std::string, std::string> *
+        resolveLibrary(const std::string &name);
+
+        static void
+        dependenciesGen(Output &out,
+                        const std::vector<std::string> &dependencies,
+                        std::vector<std::string> *cxxFlags);
+
+        /*
+         * Whether link lines drop what libtool already links through the
+         * .la files of in-tree libraries.
+         */
+        static bool _reduceLinks;
+
+        static std::vector<std::string>
+        reduceDependencies(const std::string &variable,
+                           const std::vector<std::string> &dependencies);
+
+        /*
+         * Whether the tests run through automake's parallel harness, one
+         * log per test, and in how many shards (0 when not sharded).
+         */
+        static bool   _parallelTests;
+        static size_t _testShards;
+
+        static void testGen(Output &out, const std::string &test,
+                            const std::string &runner,
+                            const std::vector<std::string> &args,
+                            bool manual,
+                            const std::vector<std::string> &addons = {});
+
+        static void registerTarget(const Target &target);
+        static void forgetTargets(const std::string &file);
+
+        typedef std::vector<std::pair<std::string, uint64_t>> Reads;
+
+        std::vector<std::shared_ptr<ExtAST>>
+        parseStatement(std::deque<Token> *tokens, Reads *reads);
+
+        void append(const std::vector<std::shared_ptr<ExtAST>> &nodes);
+
+        uint64_t attributeHash(const std::string &name) const;
+
+        static uint64_t libraryHash(const std::vector<std::string> &names);
+
+        uint64_t attributesHash() const;
+
+        void shareSources(Output &out, Shared *shared) const;
+
+        void codeGen(Output &out) const;
+        bool independent() const;
+        void subMakes(std::vector<std::string> *files) const;
+        void
+        compileOptions(std::map<std::string,
+                                std::vector<std::string>> *options) const;
     private:
+        /*
+         * What a worker thread generated for a chunk of nodes: the code,
+         * the libraries looked up and the dependencies left unresolved.
+         */
+        struct Chunk
+        {
+            Buffer                   code;
+            std::vector<std::string> usedLibraries;
+            Buffer                   unresolved;
+            Buffer                   reductions;
+            Goals                    goals;
+            std::exception_ptr       error;
+        };
+
+        static const size_t _chunkNodes = 256;
+
         std::string                                           _waitingBlock;
         std::string                                           _file;
         std::shared_ptr<Attributes>                           _attributes;
         static std::unordered_map<std::string, ParseFunction> _functions;
         std::vector<std::shared_ptr<ExtAST>>                  _AST;
+        static Reads                                          *_reads;
+        static thread_local Chunk                             *_chunk;
+
+        void codeGen(Output &out, size_t begin, size_t end) const;
+
+        static void useLibrary(std::vector<std::string> *used,
+                               const std::string &name);
 
         std::shared_ptr<ExtAST>
         parseIfeq(std::deque<Token> *tokens) const;
@@ -249,6 +894,9 @@ class BlockAST : public ExtAST
                         std::deque<Token> *tokens,
                         const std::string &file);
 
+        static std::vector<std::string>
+        attribute(const Attributes &attributes, const std::string &name);
+
         static std::vector<std::string>
         parseValues(const Attributes &attributes, const std::string &file,
                     std::deque<Token> *tokens);
@@ -305,58 +953,377 @@ BlockAST::_libraryMap = {
     { "crypto++"             , { "$(CRYPTO_LIB)", "" }                }
 };
 
-BlockAST::BlockAST(const std::string &file) : _file(file),
-    _attributes(new Attributes())
+const std::unordered_map<std::string, std::pair<std::string, std::string>>
+BlockAST::_builtinLibraryMap = BlockAST::_libraryMap;
+
+/*
+ * The names of the functions the .mk files call.
+ */
+std::vector<std::string> BlockAST::functions()
 {
-    (*_attributes)["PYTHON_ENABLED"] =
-    std::shared_ptr<AttributeAST>(new AttributeAST(AttributeAST::Type::ASSIGN,
-                                  "PYTHON_ENABLED", { "0" }));
+    std::vector<std::string> names;
+    for (const auto &function : _functions)
+        names.push_back(function.first);
 
-    (*_attributes)["BOOST_VERSION"] =
-    std::shared_ptr<AttributeAST>(new AttributeAST(AttributeAST::Type::ASSIGN,
-                                  "BOOST_VERSION", { "52" }));
+    std::sort(names.begin(), names.end());
+    return names;
 }
 
-BlockAST::BlockAST(const std::string &file,
-                   const std::shared_ptr<Attributes> &attributes,
-                   const std::string &waitingBlock)
-    : _file(file), _attributes(attributes), _waitingBlock(waitingBlock)
+std::unordered_map<std::string, BlockAST::Target> BlockAST::_targets;
+
+std::vector<std::string>        BlockAST::_roots;
+std::unordered_set<std::string> BlockAST::_needed;
+std::string                     BlockAST::_prunedIf;
+
+BlockAST::Reads *BlockAST::_reads = nullptr;
+
+thread_local BlockAST::Chunk *BlockAST::_chunk = nullptr;
+
+unsigned BlockAST::_jobs = std::thread::hardware_concurrency();
+
+std::string BlockAST::_prefix;
+
+std::string BlockAST::path(const std::string &name)
 {
+    return _prefix + name;
 }
 
-BlockAST::~BlockAST()
+/*
+ * The automake variable prefix for name: the directory canonicalized the
+ * way automake does it.
+ */
+std::string BlockAST::variable(const std::string &name)
 {
+    auto prefix = _prefix;
+    for (auto &c : prefix)
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '@' && c != '_')
+            c = '_';
+
+    return prefix + name;
 }
 
-void BlockAST::parse(std::deque<Token> *tokens)
+void BlockAST::pathsGen(Output &out, const std::vector<std::string> &names)
 {
-    while (!tokens->empty()) {
-        switch (tokens->front().type()) {
-            case Token::Type::NEW_LINE:
-            case Token::Type::SPACE:
-                tokens->pop_front();
-            break;
-            case Token::Type::ALPHANUM:
-                if (tokens->front().value() == "ifeq") {
-                    _AST.push_back(parseIfeq(tokens));
-                }
-                else if (tokens->front().value() == "endif") {
-                    if (_waitingBlock != "ifeq")
-                        throw new Exception("Not expecting an endif at this"
-                                            " point");
+    for (const auto &name : names) {
+        if (&name != &names[0])
+            out << " \\\n  ";
 
-                    tokens->pop_front();
-                    return;
-                }
-                else {
-                    auto attr = parseAttribute(tokens);
-                    if (attr) {
-                        if (attr->type() == AttributeAST::Type::ASSIGN) {
-                            (*_attributes)[attr->key()] = attr;
-                        }
-                        else {
-                            auto t = _attributes->find(attr->key());
-                            if (t == _attributes->end())
+        out << _prefix << name;
+    }
+}
+
+BlockAST::Goals *BlockAST::_goals = nullptr;
+
+void BlockAST::buildGoal(const std::string &path)
+{
+    auto goals = _chunk ? &_chunk->goals : _goals;
+    if (goals)
+        goals->all.push_back(path);
+}
+
+void BlockAST::checkGoal(const std::string &path)
+{
+    auto goals = _chunk ? &_chunk->goals : _goals;
+    if (goals)
+        goals->check.push_back(path);
+}
+
+/*
+ * Turns the make $(VAR) references of _libraryMap into ninja ${VAR} ones,
+ * defined by config.ninja.
+ */
+std::string BlockAST::ninjaVariables(const std::string &value)
+{
+    std::string result;
+    for (size_t i = 0; i < value.size(); ++i) {
+        auto end = value.find(')', i);
+        if (value.compare(i, 2, "$(") == 0 && end != std::string::npos) {
+            result += "${" + value.substr(i + 2, end - i - 2) + "}";
+            i = end;
+        }
+        else
+            result += value[i];
+    }
+
+    return result;
+}
+
+/*
+ * Splits dependencies the way a ninja link wants them: the libraries built
+ * here are both implicit inputs and libs, the others only libs. Unresolved
+ * dependencies are linked with -l.
+ */
+void BlockAST::ninjaDependencies(const std::vector<std::string> &dependencies,
+                                 std::vector<std::string> *inputs,
+                                 std::vector<std::string> *libs,
+                                 std::vector<std::string> *cxxFlags)
+{
+    for (const auto &dependency : dependencies) {
+        auto t = resolveLibrary(dependency);
+        if (!t) {
+            libs->push_back("-l" + dependency);
+            continue;
+        }
+
+        if (t->first.compare(0, 10, "$builddir/") == 0)
+            inputs->push_back(t->first);
+
+        libs->push_back(ninjaVariables(t->first));
+        if (!t->second.empty())
+            cxxFlags->push_back(ninjaVariables(t->second));
+    }
+}
+
+/*
+ * Writes a compile edge per source, with objects kept per target the way
+ * automake does, and returns the objects.
+ */
+std::vector<std::string>
+BlockAST::ninjaObjectsGen(Output &out, const std::string &target,
+                          const std::vector<std::string> &sources,
+                          const std::vector<std::string> &cxxFlags,
+                          const std::vector<std::string> *unityExclude)
+{
+    std::vector<std::string> objects, separate = sources;
+    std::vector<std::vector<std::string>> groups;
+    if (unityExclude) {
+        auto exclude = *unityExclude;
+        for (const auto &source : sources)
+            if (sourceOptions(source))
+                exclude.push_back(source);
+
+        separate.clear();
+        groups = unityGroups(sources, exclude, &separate);
+    }
+
+    for (size_t i = 0; i < groups.size(); ++i) {
+        auto unity = "$builddir/unity/" + path(target) + "-unity-"
+                     + std::to_string(i + 1) + ".cc";
+        objects.push_back("$builddir/obj/" + path(target) + "/unity-"
+                          + std::to_string(i + 1) + ".o");
+
+        out << "build " << unity << ": unity\n  sources =";
+        for (const auto &source : groups[i])
+            out << " " << path(source);
+
+        out << "\nbuild " << objects.back() << ": cxx " << unity << "\n";
+        if (!cxxFlags.empty())
+            out << "  flags = " << join(cxxFlags, " ") << "\n";
+    }
+
+    for (const auto &source : separate) {
+        objects.push_back("$builddir/obj/" + path(target) + "/"
+                          + source.substr(0, source.find_last_of('.'))
+                          + ".o");
+
+        auto flags = cxxFlags;
+        auto options = sourceOptions(source);
+        if (options)
+            flags.insert(flags.end(), options->begin(), options->end());
+
+        out << "build " << objects.back() << ": cxx " << path(source) << "\n";
+        if (!flags.empty())
+            out << "  flags = " << join(flags, " ") << "\n";
+    }
+
+    return objects;
+}
+
+void BlockAST::ninjaLinkGen(Output &out, const std::string &rule,
+                            const std::string &output,
+                            const std::vector<std::string> &objects,
+                            const std::vector<std::string> &inputs,
+                            const std::vector<std::string> &libs,
+                            const std::string &rpath)
+{
+    out << "build " << output << ": " << rule << " " << join(objects, " ");
+    if (!inputs.empty())
+        out << " | " << join(inputs, " ");
+
+    out << "\n";
+    if (!libs.empty())
+        out << "  libs = " << join(libs, " ") << "\n";
+
+    out << "  rpath = " << rpath << "\n\n";
+}
+
+size_t BlockAST::_unitySize = 0;
+
+/*
+ * Splits sources into balanced groups of at most _unitySize, leaving the
+ * excluded ones and the ones that aren't C++ in separate. Nothing is
+ * grouped unless at least two sources can be.
+ */
+std::vector<std::vector<std::string>>
+BlockAST::unityGroups(const std::vector<std::string> &sources,
+                      const std::vector<std::string> &exclude,
+                      std::vector<std::string> *separate)
+{
+    std::vector<std::string> grouped;
+    for (const auto &source : sources) {
+        auto dot = source.find_last_of('.');
+        auto extension = dot == std::string::npos ? "" : source.substr(dot);
+
+        if (_unitySize && (extension == ".cc" || extension == ".cpp" ||
+                           extension == ".cxx") &&
+            std::find(exclude.begin(), exclude.end(), source) == exclude.end())
+            grouped.push_back(source);
+        else
+            separate->push_back(source);
+    }
+
+    std::vector<std::vector<std::string>> groups;
+    if (grouped.size() < 2) {
+        separate->insert(separate->end(), grouped.begin(), grouped.end());
+        return groups;
+    }
+
+    auto count = (grouped.size() + _unitySize - 1) / _unitySize;
+    for (size_t i = 0, begin = 0; i < count; ++i) {
+        auto end = begin + grouped.size() / count
+                   + (i < grouped.size() % count ? 1 : 0);
+        groups.emplace_back(grouped.begin() + begin, grouped.begin() + end);
+        begin = end;
+    }
+
+    return groups;
+}
+
+/*
+ * Writes variable_SOURCES. In unity builds the sources that can be grouped
+ * move to nodist_variable_SOURCES, as the amalgamations stem-unity-N.cc
+ * and the rules writing them, which only touch them when they change.
+ */
+void BlockAST::sourcesGen(Output &out, const std::string &variable,
+                          const std::string &stem,
+                          const std::vector<std::string> &sources,
+                          const std::vector<std::string> &unityExclude)
+{
+    std::vector<std::string> separate;
+    auto groups = unityGroups(sources, unityExclude, &separate);
+    if (groups.empty()) {
+        out << variable << "_SOURCES = \\\n  ";
+        pathsGen(out, sources);
+        return;
+    }
+
+    out << variable << "_SOURCES =";
+    if (!separate.empty()) {
+        out << " \\\n  ";
+        pathsGen(out, separate);
+    }
+
+    out << "\n\nnodist_" << variable << "_SOURCES =";
+    for (size_t i = 0; i < groups.size(); ++i)
+        out << " \\\n  " << stem << "-unity-" << std::to_string(i + 1)
+            << ".cc";
+
+    for (size_t i = 0; i < groups.size(); ++i) {
+        auto file = stem + "-unity-" + std::to_string(i + 1) + ".cc";
+
+        out << "\n\n" << file << ": Makefile\n"
+            << "\t$(AM_V_GEN)printf '#include \"%s\"\\n'";
+        for (const auto &source : groups[i])
+            out << " $(abs_srcdir)/" << path(source);
+
+        out << " > $@-t && \\\n"
+            << "\t  { cmp -s $@-t $@ && rm -f $@-t || mv -f $@-t $@; }\n"
+            << "CLEANFILES += " << file;
+    }
+}
+
+bool BlockAST::_pch = false;
+bool BlockAST::_inferPch = false;
+
+bool                   BlockAST::_shareSources = false;
+const BlockAST::Shared *BlockAST::_shared = nullptr;
+bool                   BlockAST::_addonList = false;
+
+const BlockAST::SharedSources *BlockAST::sharedSources(const ExtAST *node)
+{
+    if (!_shared)
+        return nullptr;
+
+    auto t = _shared->targets.find(node);
+    return t == _shared->targets.end() ? nullptr : &t->second;
+}
+
+const std::vector<std::string> *
+BlockAST::sourceOptions(const std::string &source)
+{
+    if (!_shared)
+        return nullptr;
+
+    auto t = _shared->options.find(source);
+    return t == _shared->options.end() ? nullptr : &t->second;
+}
+
+/*
+ * The rpath finding $builddir/lib from what dir (bin/ or tests/) has for
+ * the .mk being generated.
+ */
+std::string BlockAST::ninjaRpath(const std::string &dir)
+{
+    std::string rpath = "$$ORIGIN/";
+    for (auto c : path(dir))
+        if (c == '/')
+            rpath += "../";
+
+    return rpath + "lib";
+}
+
+BlockAST::BlockAST(const std::string &file) : _file(file),
+    _attributes(new Attributes())
+{
+    (*_attributes)["PYTHON_ENABLED"] =
+    std::shared_ptr<AttributeAST>(new AttributeAST(AttributeAST::Type::ASSIGN,
+                                  "PYTHON_ENABLED", { "0" }));
+
+    (*_attributes)["BOOST_VERSION"] =
+    std::shared_ptr<AttributeAST>(new AttributeAST(AttributeAST::Type::ASSIGN,
+                                  "BOOST_VERSION", { "52" }));
+}
+
+BlockAST::BlockAST(const std::string &file,
+                   const std::shared_ptr<Attributes> &attributes,
+                   const std::string &waitingBlock)
+    : _file(file), _attributes(attributes), _waitingBlock(waitingBlock)
+{
+}
+
+BlockAST::~BlockAST()
+{
+}
+
+void BlockAST::parse(std::deque<Token> *tokens)
+{
+    while (!tokens->empty()) {
+        switch (tokens->front().type()) {
+            case Token::Type::NEW_LINE:
+            case Token::Type::SPACE:
+                tokens->pop_front();
+            break;
+            case Token::Type::ALPHANUM:
+                if (tokens->front().value() == "ifeq") {
+                    _AST.push_back(parseIfeq(tokens));
+                }
+                else if (tokens->front().value() == "endif") {
+                    if (_waitingBlock != "ifeq")
+                        throw new Exception("Not expecting an endif at this"
+                                            " point");
+
+                    tokens->pop_front();
+                    return;
+                }
+                else {
+                    auto attr = parseAttribute(tokens);
+                    if (attr) {
+                        if (attr->type() == AttributeAST::Type::ASSIGN) {
+                            (*_attributes)[attr->key()] = attr;
+                        }
+                        else {
+                            auto t = _attributes->find(attr->key());
+                            if (t == _attributes->end())
                                 throw Exception("Can't find attribute "
                                                 + attr->key());
                             else {
@@ -390,88 +1357,2796 @@ void BlockAST::parse(std::deque<Token> *tokens)
     }
 }
 
-std::string BlockAST::codeGen() const
+/*
+ * Long runs of independent nodes are generated in chunks on _jobs threads
+ * and stitched back in order. The other nodes (sub makes) run serially, in
+ * between, since what they register changes how later nodes resolve.
+ */
+void BlockAST::codeGen(Output &out) const
+{
+    for (size_t i = 0; i < _AST.size();) {
+        auto end = i;
+        while (end < _AST.size() && _AST[end]->independent())
+            ++end;
+
+        if (_jobs > 1 && !_chunk && end - i >= 2 * _chunkNodes)
+            codeGen(out, i, end);
+        else {
+            for (auto j = i; j < end; ++j)
+                nodeGen(*_AST[j], out);
+        }
+
+        if (end < _AST.size())
+            nodeGen(*_AST[end++], out);
+
+        i = end;
+    }
+}
+
+bool BlockAST::independent() const
+{
+    for (const auto &element : _AST)
+        if (!element->independent())
+            return false;
+
+    return true;
+}
+
+/*
+ * Parses one top level statement, returning the nodes it produced and the
+ * attributes (with a hash of their values) it expanded on the way.
+ */
+std::vector<std::shared_ptr<ExtAST>>
+BlockAST::parseStatement(std::deque<Token> *tokens, Reads *reads)
+{
+    auto size = _AST.size();
+    auto previous = _reads;
+    _reads = reads;
+
+    try {
+        parse(tokens);
+    } catch (...) {
+        _reads = previous;
+        throw;
+    }
+
+    _reads = previous;
+    return std::vector<std::shared_ptr<ExtAST>>(_AST.begin() + size,
+                                                _AST.end());
+}
+
+void BlockAST::append(const std::vector<std::shared_ptr<ExtAST>> &nodes)
+{
+    _AST.insert(_AST.end(), nodes.begin(), nodes.end());
+}
+
+uint64_t BlockAST::attributeHash(const std::string &name) const
+{
+    auto v = _attributes->find(name);
+    if (v == _attributes->end())
+        return 0;
+
+    return hashString(join(v->second->value(), " "));
+}
+
+uint64_t BlockAST::libraryHash(const std::vector<std::string> &names)
+{
+    auto hash = hashString("");
+    for (const auto &name : names) {
+        hash = hashString(name + '\0', hash);
+
+        auto t = _libraryMap.find(name);
+        if (t != _libraryMap.end())
+            hash = hashString(t->second.first + '\0' + t->second.second + '\0',
+                              hash);
+
+        auto target = _targets.find(name);
+        if (_reduceLinks && target != _targets.end())
+            hash = hashString(join(target->second.dependencies, " ") + '\0',
+                              hash);
+
+        if (target != _targets.end() && target->second.type == "nodejs_addon")
+            hash = hashString(target->second.file + '\0', hash);
+    }
+
+    return hash;
+}
+
+uint64_t BlockAST::attributesHash() const
+{
+    std::map<std::string, std::vector<std::string>> sorted;
+    for (const auto &attribute : *_attributes)
+        sorted[attribute.first] = attribute.second->value();
+
+    auto hash = hashString("");
+    for (const auto &attribute : sorted)
+        hash = hashString(attribute.first + "=" + join(attribute.second, " ")
+                          + '\0', hash);
+
+    return hash;
+}
+
+void BlockAST::subMakes(std::vector<std::string> *files) const
+{
+    for (const auto &element : _AST)
+        element->subMakes(files);
+}
+
+void BlockAST::compileOptions(std::map<std::string,
+                                       std::vector<std::string>> *options)
+    const
 {
-    std::string code;
     for (const auto &element : _AST)
-        code += element->codeGen();
+        element->compileOptions(options);
+}
+
+class SubMakesAST : public ExtAST
+{
+    public:
+        SubMakesAST(const std::vector<std::string> &subDirs,
+                    const std::string &dir)
+            : _subDirs(subDirs), _dir(dir)
+        {
+        }
+
+        const std::vector<std::string> &subDirs() const;
+
+        void codeGen(Output &out) const;
+        bool independent() const;
+        void subMakes(std::vector<std::string> *files) const;
+
+    private:
+        std::vector<std::string> _subDirs;
+        std::string              _dir;
+};
+
+/*
+ * Remembers, for every generated Makefile.am, what it was generated from:
+ * the .mk contents, the attributes it started with and the tool version
+ * (inputHash), the _libraryMap entries it looked up (libraryHash), what its
+ * sub makes define and use when SUBDIRS is ordered (subtreeHash), the
+ * libraries it registered and the sub makes it recursed into. An output whose
+ * hashes still match is not regenerated, its side effects are just replayed.
+ * The outputs a pass didn't get to are dropped.
+ */
+class Manifest
+{
+    public:
+        struct Entry
+        {
+            uint64_t                                         inputHash = 0;
+            uint64_t                                         libraryHash = 0;
+            uint64_t                                         subtreeHash = 0;
+            std::vector<std::string>                         usedLibraries;
+            std::vector<std::pair<std::string, std::string>> libraries;
+            std::vector<std::pair<std::string, std::string>> subMakes;
+            std::vector<BlockAST::Target>                    targets;
+        };
+
+        typedef std::function<std::string(const std::string &)> PathMap;
+
+        Manifest(const std::string &file);
+
+        static void write(std::ostream &out, const Entry &entry,
+                          const PathMap &path);
+        static bool read(const std::string &line, Entry *entry,
+                         const PathMap &path);
+
+        void load();
+        void save() const;
+
+        const Entry *find(const std::string &output) const;
+        void update(const std::string &output, const Entry &entry);
+        void erase(const std::string &output);
+        void retain(const std::unordered_set<std::string> &outputs);
+        void clear();
+
+        const std::unordered_map<std::string, Entry> &entries() const;
+    private:
+        std::string                            _file;
+        std::unordered_map<std::string, Entry> _entries;
+        bool                                   _dirty = false;
+};
+
+Manifest::Manifest(const std::string &file) : _file(file)
+{
+}
+
+void Manifest::write(std::ostream &out, const Entry &entry,
+                     const PathMap &path)
+{
+    for (const auto &name : entry.usedLibraries)
+        out << "use " << name << "\n";
+
+    for (const auto &library : entry.libraries)
+        out << "lib " << library.first << " " << path(library.second) << "\n";
 
-    return code;
+    for (const auto &subMake : entry.subMakes)
+        out << "sub " << path(subMake.first) << " " << path(subMake.second)
+            << "\n";
+
+    for (const auto &target : entry.targets) {
+        out << "target " << target.name << " " << target.type << " "
+            << path(target.file) << "\n";
+
+        for (const auto &source : target.sources)
+            out << "source " << source << "\n";
+
+        for (const auto &dependency : target.dependencies)
+            out << "dependency " << dependency << "\n";
+    }
+}
+
+bool Manifest::read(const std::string &line, Entry *entry, const PathMap &path)
+{
+    std::istringstream fields(line);
+
+    std::string kind, first, second, third;
+    fields >> kind >> first >> second >> third;
+
+    if (kind == "use")
+        entry->usedLibraries.push_back(first);
+    else if (kind == "lib")
+        entry->libraries.emplace_back(first, path(second));
+    else if (kind == "sub")
+        entry->subMakes.emplace_back(path(first), path(second));
+    else if (kind == "target")
+        entry->targets.push_back({ first, second, path(third), {}, {} });
+    else if (kind == "source" && !entry->targets.empty())
+        entry->targets.back().sources.push_back(first);
+    else if (kind == "dependency" && !entry->targets.empty())
+        entry->targets.back().dependencies.push_back(first);
+    else
+        return false;
+
+    return true;
+}
+
+void Manifest::load()
+{
+    std::ifstream is(_file);
+
+    std::string line;
+    if (!std::getline(is, line) || line != "mk_parser " MK_PARSER_VERSION)
+        return;
+
+    auto identity = [](const std::string &path) { return path; };
+
+    Entry *entry = nullptr;
+    while (std::getline(is, line)) {
+        std::istringstream fields(line);
+
+        std::string kind;
+        fields >> kind;
+        if (kind == "output") {
+            std::string output;
+            fields >> output;
+
+            entry = &_entries[output];
+            *entry = Entry();
+            fields >> std::hex >> entry->inputHash >> entry->libraryHash
+                   >> entry->subtreeHash;
+        }
+        else if (!entry || !read(line, entry, identity))
+            throw Exception("Invalid manifest: " + _file);
+    }
+}
+
+void Manifest::save() const
+{
+    if (!_dirty || _file.empty())
+        return;
+
+    std::ostringstream out;
+    out << "mk_parser " MK_PARSER_VERSION "\n";
+    for (const auto &it : _entries) {
+        const auto &entry = it.second;
+        out << "output " << it.first << std::hex << " " << entry.inputHash
+            << " " << entry.libraryHash << " " << entry.subtreeHash
+            << std::dec << "\n";
+
+        write(out, entry, [](const std::string &path) { return path; });
+    }
+
+    if (!writeFile(_file, out.str()))
+        throw Exception("Can't write " + _file);
+}
+
+const Manifest::Entry *Manifest::find(const std::string &output) const
+{
+    auto it = _entries.find(output);
+    return it == _entries.end() ? nullptr : &it->second;
+}
+
+void Manifest::update(const std::string &output, const Entry &entry)
+{
+    _entries[output] = entry;
+    _dirty = true;
+}
+
+void Manifest::erase(const std::string &output)
+{
+    _dirty = _entries.erase(output) || _dirty;
+}
+
+/*
+ * Drops the entries of the outputs not in outputs.
+ */
+void Manifest::retain(const std::unordered_set<std::string> &outputs)
+{
+    for (auto it = _entries.begin(); it != _entries.end();) {
+        if (outputs.count(it->first)) {
+            ++it;
+            continue;
+        }
+
+        it = _entries.erase(it);
+        _dirty = true;
+    }
+}
+
+void Manifest::clear()
+{
+    _dirty = _dirty || !_entries.empty();
+    _entries.clear();
+}
+
+const std::unordered_map<std::string, Manifest::Entry> &
+Manifest::entries() const
+{
+    return _entries;
+}
+
+/*
+ * Binary image of a lexed .mk file, one per source under the cache directory:
+ *
+ *   Header | Record[count] | string table
+ *
+ * Records only hold offsets into the string table, so the image is valid
+ * wherever it gets mapped and is read in place straight from the mapping.
+ */
+class TokenCache
+{
+    public:
+        TokenCache(const std::string &dir);
+
+        bool load(const std::string &file, uint64_t contentHash,
+                  std::deque<Token> *tokens) const;
+
+        void store(const std::string &file, uint64_t contentHash,
+                   const std::deque<Token> &tokens) const;
+    private:
+        static const uint32_t _version = 1;
+
+        struct Header
+        {
+            char     magic[8];
+            uint32_t version;
+            uint32_t count;
+            uint64_t contentHash;
+            uint64_t stringsSize;
+        };
+
+        struct Record
+        {
+            uint32_t type;
+            uint32_t offset;
+            uint32_t length;
+        };
+
+        std::string _dir;
+
+        std::string path(const std::string &file) const;
+};
+
+TokenCache::TokenCache(const std::string &dir) : _dir(dir)
+{
+}
+
+std::string TokenCache::path(const std::string &file) const
+{
+    std::stringstream path;
+    path << _dir << "/" << std::hex << hashString(file) << ".tok";
+
+    return path.str();
+}
+
+bool TokenCache::load(const std::string &file, uint64_t contentHash,
+                      std::deque<Token> *tokens) const
+{
+    auto fd = open(path(file).c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(Header)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    auto image = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return false;
+
+    /*
+     * Sizes are checked by subtracting from that of the file, so that a
+     * corrupted count or stringsSize can't wrap around.
+     */
+    auto header = static_cast<const Header *>(image);
+    uint64_t recordsSize = uint64_t(header->count) * sizeof(Record);
+
+    bool valid = memcmp(header->magic, "MKTOKENS", 8) == 0 &&
+                 header->version == _version &&
+                 header->contentHash == contentHash &&
+                 recordsSize <= size - sizeof(Header) &&
+                 header->stringsSize == size - sizeof(Header) - recordsSize;
+
+    auto records = reinterpret_cast<const Record *>(header + 1);
+    auto strings = reinterpret_cast<const char *>(header + 1) + recordsSize;
+
+    for (uint32_t i = 0; valid && i < header->count; ++i) {
+        const auto &record = records[i];
+        if (uint64_t(record.offset) + record.length > header->stringsSize) {
+            valid = false;
+            break;
+        }
+
+        tokens->emplace_back(static_cast<Token::Type>(record.type),
+                             std::string(strings + record.offset,
+                                         record.length));
+    }
+
+    munmap(image, size);
+
+    if (!valid)
+        tokens->clear();
+
+    return valid;
+}
+
+void TokenCache::store(const std::string &file, uint64_t contentHash,
+                       const std::deque<Token> &tokens) const
+{
+    std::vector<Record> records;
+    records.reserve(tokens.size());
+
+    std::string strings;
+    for (const auto &token : tokens) {
+        records.push_back({ static_cast<uint32_t>(token.type()),
+                            static_cast<uint32_t>(strings.size()),
+                            static_cast<uint32_t>(token.value().size()) });
+        strings += token.value();
+    }
+
+    Header header;
+    memcpy(header.magic, "MKTOKENS", 8);
+    header.version = _version;
+    header.count = records.size();
+    header.contentHash = contentHash;
+    header.stringsSize = strings.size();
+
+    std::string image(reinterpret_cast<const char *>(&header), sizeof(header));
+    image.append(reinterpret_cast<const char *>(records.data()),
+                 records.size() * sizeof(Record));
+    image += strings;
+
+    writeFile(path(file), image);
+}
+
+/*
+ * Generated Makefile.am files shared between checkouts of the same tree.
+ *
+ * <key>.idx holds what an output needs besides its text (the libraries it
+ * registers, the sub makes it visits and the library names it resolves) and
+ * is keyed by the lexed .mk, its starting attributes, its path and the tool
+ * version. <key>-<libraries>.am holds the text itself for one resolution of
+ * those library names. Paths below the base directory are stored relative to
+ * it, entries are replaced atomically and the least recently used ones are
+ * evicted once the directory grows past its size limit.
+ */
+class OutputCache
+{
+    public:
+        OutputCache(const std::string &dir, const std::string &baseDir,
+                    uint64_t maxSize);
+
+        uint64_t key(const std::string &generator, const std::string &file,
+                     const std::deque<Token> &tokens, uint64_t attributesHash,
+                     const std::vector<std::string> &subDirs) const;
+
+        bool findEntry(uint64_t key, Manifest::Entry *entry);
+        bool fetch(uint64_t key, const Manifest::Entry &entry,
+                   std::string *code);
+        void store(uint64_t key, const Manifest::Entry &entry,
+                   const std::string &code) const;
+
+        void evict();
+
+        size_t hits() const;
+        size_t misses() const;
+        size_t evictions() const;
+    private:
+        std::string _dir;
+        std::string _baseDir;
+        uint64_t    _maxSize;
+        size_t      _hits = 0;
+        size_t      _misses = 0;
+        size_t      _evictions = 0;
+
+        std::string relative(const std::string &s) const;
+        std::string absolute(const std::string &s) const;
+
+        std::string outputPath(uint64_t key,
+                               const Manifest::Entry &entry) const;
+        std::string path(uint64_t key, const std::string &suffix) const;
+};
+
+OutputCache::OutputCache(const std::string &dir, const std::string &baseDir,
+                         uint64_t maxSize)
+    : _dir(dir), _baseDir(absolutePath(baseDir, currentDir())),
+      _maxSize(maxSize)
+{
+    if (_baseDir != "/")
+        _baseDir += "/";
+}
+
+/*
+ * Only where _baseDir starts a path: at the start of a word, after = or
+ * after -I.
+ */
+std::string OutputCache::relative(const std::string &s) const
+{
+    std::string result;
+    size_t last = 0;
+    for (auto pos = s.find(_baseDir); pos != std::string::npos;
+         pos = s.find(_baseDir, pos + 1)) {
+        if (pos > 0 && !isspace(static_cast<unsigned char>(s[pos - 1])) &&
+            s[pos - 1] != '=' && s.compare(pos - std::min<size_t>(pos, 2),
+                                           2, "-I") != 0)
+            continue;
+
+        result.append(s, last, pos - last);
+        result += "@MK_BASEDIR@/";
+        last = pos + _baseDir.size();
+        pos = last - 1;
+    }
+
+    return result.append(s, last, std::string::npos);
+}
+
+std::string OutputCache::absolute(const std::string &s) const
+{
+    return replaceAll(s, "@MK_BASEDIR@/", _baseDir);
+}
+
+std::string OutputCache::path(uint64_t key, const std::string &suffix) const
+{
+    std::stringstream path;
+    path << _dir << "/" << std::hex << key << suffix;
+
+    return path.str();
+}
+
+std::string OutputCache::outputPath(uint64_t key,
+                                    const Manifest::Entry &entry) const
+{
+    auto hash = hashString("");
+    for (const auto &name : entry.usedLibraries) {
+        hash = hashString(name + '\0', hash);
+
+        auto t = BlockAST::_libraryMap.find(name);
+        if (t != BlockAST::_libraryMap.end())
+            hash = hashString(relative(t->second.first) + '\0'
+                              + t->second.second + '\0', hash);
+    }
+
+    if (entry.subtreeHash)
+        hash = hashString(std::to_string(entry.subtreeHash), hash);
+
+    std::stringstream suffix;
+    suffix << "-" << std::hex << hash << ".am";
+
+    return path(key, suffix.str());
+}
+
+uint64_t OutputCache::key(const std::string &generator,
+                          const std::string &file,
+                          const std::deque<Token> &tokens,
+                          uint64_t attributesHash,
+                          const std::vector<std::string> &subDirs) const
+{
+    auto hash = hashString(generator);
+    hash = hashString(relative(file) + '\0', hash);
+    hash = hashString(join(subDirs, " ") + '\0', hash);
+    hash = hashString(std::to_string(attributesHash) + '\0', hash);
+
+    for (const auto &token : tokens)
+        hash = hashString(std::to_string(static_cast<int>(token.type())) + ' '
+                          + token.value() + '\0', hash);
+
+    return hash;
+}
+
+bool OutputCache::findEntry(uint64_t key, Manifest::Entry *entry)
+{
+    std::ifstream is(path(key, ".idx"));
+    if (!is) {
+        ++_misses;
+        return false;
+    }
+
+    auto absolute = [this](const std::string &path) {
+        return this->absolute(path);
+    };
+
+    std::string line;
+    while (std::getline(is, line))
+        Manifest::read(line, entry, absolute);
+
+    return true;
+}
+
+bool OutputCache::fetch(uint64_t key, const Manifest::Entry &entry,
+                        std::string *code)
+{
+    auto output = outputPath(key, entry);
+
+    std::ifstream is(output);
+    if (!is) {
+        ++_misses;
+        return false;
+    }
+
+    std::stringstream content;
+    content << is.rdbuf();
+    *code = absolute(content.str());
+
+    utimensat(AT_FDCWD, output.c_str(), nullptr, 0);
+    utimensat(AT_FDCWD, path(key, ".idx").c_str(), nullptr, 0);
+
+    ++_hits;
+    return true;
+}
+
+void OutputCache::store(uint64_t key, const Manifest::Entry &entry,
+                        const std::string &code) const
+{
+    std::stringstream index;
+    Manifest::write(index, entry, [this](const std::string &path) {
+        return relative(path);
+    });
+
+    writeFile(path(key, ".idx"), index.str());
+    writeFile(outputPath(key, entry), relative(code));
+}
+
+void OutputCache::evict()
+{
+    auto dir = opendir(_dir.c_str());
+    if (!dir)
+        return;
+
+    std::vector<std::pair<time_t, std::pair<std::string, uint64_t>>> files;
+    uint64_t total = 0;
+
+    while (auto entry = readdir(dir)) {
+        auto file = _dir + "/" + entry->d_name;
+
+        struct stat st;
+        if (stat(file.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        files.push_back({ st.st_mtime, { file, uint64_t(st.st_size) } });
+        total += st.st_size;
+    }
+
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+    for (const auto &file : files) {
+        if (total <= _maxSize)
+            break;
+
+        if (unlink(file.second.first.c_str()) == 0) {
+            total -= file.second.second;
+            ++_evictions;
+        }
+    }
+}
+
+size_t OutputCache::hits() const
+{
+    return _hits;
+}
+
+size_t OutputCache::misses() const
+{
+    return _misses;
+}
+
+size_t OutputCache::evictions() const
+{
+    return _evictions;
+}
+
+/*
+ * Collects the outputs of a whole pass and writes the ones that changed in
+ * one go at the end of it: each changed file goes to a temporary file which
+ * is then renamed over it, in the order the outputs were added. create()
+ * picks io_uring when the kernel has it and a pool of threads otherwise.
+ */
+class Writer
+{
+    public:
+        static std::shared_ptr<Writer> create(bool sync);
+
+        virtual ~Writer();
+
+        void add(const std::string &file, Buffer &&data);
+        size_t flush();
+    protected:
+        struct Pending
+        {
+            std::string        file;
+            std::string        temp;
+            Buffer             data;
+            std::vector<iovec> iov;
+        };
+
+        Writer(bool sync);
+
+        bool _sync;
+
+        virtual void write(std::vector<Pending *> *changed) = 0;
+    private:
+        std::vector<Pending> _pending;
+};
+
+class ThreadWriter : public Writer
+{
+    public:
+        ThreadWriter(bool sync);
+    private:
+        void write(std::vector<Pending *> *changed);
+};
+
+/*
+ * Talks to the kernel directly, one submission per stage (open, write and
+ * fsync, close, rename) for up to _entries files at a time.
+ */
+class UringWriter : public Writer
+{
+    public:
+        static std::shared_ptr<UringWriter> create(bool sync);
+
+        ~UringWriter();
+    private:
+        static const unsigned _entries = 256;
+
+        int           _fd;
+        io_uring_params _params;
+        void          *_sq;
+        size_t        _sqSize;
+        void          *_cq;
+        size_t        _cqSize;
+        io_uring_sqe  *_sqes;
+
+        UringWriter(bool sync);
+
+        bool setup();
+
+        io_uring_sqe *sqe();
+        void submit(unsigned count, std::vector<int> *results);
+
+        void write(std::vector<Pending *> *changed);
+};
+
+Writer::Writer(bool sync) : _sync(sync)
+{
+}
+
+Writer::~Writer()
+{
+}
+
+std::shared_ptr<Writer> Writer::create(bool sync)
+{
+    auto uring = UringWriter::create(sync);
+    if (uring)
+        return uring;
+
+    return std::make_shared<ThreadWriter>(sync);
+}
+
+void Writer::add(const std::string &file, Buffer &&data)
+{
+    _pending.emplace_back();
+    _pending.back().file = file;
+    _pending.back().data = std::move(data);
+}
+
+/*
+ * Returns how many files were actually written.
+ */
+size_t Writer::flush()
+{
+    std::vector<Pending *> changed;
+    for (auto &pending : _pending) {
+        pending.iov = pending.data.iov();
+        if (sameContent(pending.file, pending.iov))
+            continue;
+
+        pending.temp = pending.file + ".tmp." + std::to_string(getpid());
+        changed.push_back(&pending);
+    }
+
+    try {
+        if (!changed.empty())
+            write(&changed);
+    } catch (...) {
+        for (auto pending : changed)
+            unlink(pending->temp.c_str());
+
+        _pending.clear();
+        throw;
+    }
+
+    _pending.clear();
+    return changed.size();
+}
+
+ThreadWriter::ThreadWriter(bool sync) : Writer(sync)
+{
+}
+
+void ThreadWriter::write(std::vector<Pending *> *changed)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < changed->size();) {
+            auto pending = (*changed)[i];
+
+            auto fd = open(pending->temp.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            bool ok = fd >= 0 && writeAll(fd, pending->iov) &&
+                      (!_sync || fsync(fd) == 0);
+
+            if (fd < 0 || close(fd) != 0 || !ok)
+                failed = true;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    auto count = std::min<size_t>(std::max(1u,
+                                           std::thread::hardware_concurrency()),
+                                  changed->size());
+    for (size_t i = 1; i < count; ++i)
+        threads.emplace_back(worker);
+
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+
+    if (failed)
+        throw Exception("Can't write the generated files");
+
+    for (auto pending : *changed)
+        if (rename(pending->temp.c_str(), pending->file.c_str()) != 0)
+            throw Exception("Can't write " + pending->file);
+}
+
+std::shared_ptr<UringWriter> UringWriter::create(bool sync)
+{
+    std::shared_ptr<UringWriter> writer(new UringWriter(sync));
+    if (!writer->setup())
+        return nullptr;
+
+    return writer;
+}
+
+UringWriter::UringWriter(bool sync)
+    : Writer(sync), _fd(-1), _sq(MAP_FAILED), _sqSize(0), _cq(MAP_FAILED),
+      _cqSize(0), _sqes(static_cast<io_uring_sqe *>(MAP_FAILED))
+{
+    memset(&_params, 0, sizeof(_params));
+}
+
+UringWriter::~UringWriter()
+{
+    if (_sqes != MAP_FAILED)
+        munmap(_sqes, _params.sq_entries * sizeof(io_uring_sqe));
+
+    if (_cq != MAP_FAILED && _cq != _sq)
+        munmap(_cq, _cqSize);
+
+    if (_sq != MAP_FAILED)
+        munmap(_sq, _sqSize);
+
+    if (_fd >= 0)
+        close(_fd);
+}
+
+bool UringWriter::setup()
+{
+    _fd = syscall(__NR_io_uring_setup, _entries, &_params);
+    if (_fd < 0)
+        return false;
+
+    io_uring_probe *probe = static_cast<io_uring_probe *>(
+        calloc(1, sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)));
+    bool supported = syscall(__NR_io_uring_register, _fd,
+                             IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (auto op : { IORING_OP_OPENAT, IORING_OP_WRITEV, IORING_OP_FSYNC,
+                     IORING_OP_CLOSE, IORING_OP_RENAMEAT })
+        supported = supported && op <= probe->last_op &&
+                    (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    if (!supported)
+        return false;
+
+    _sqSize = _params.sq_off.array + _params.sq_entries * sizeof(unsigned);
+    _cqSize = _params.cq_off.cqes + _params.cq_entries * sizeof(io_uring_cqe);
+    if (_params.features & IORING_FEAT_SINGLE_MMAP)
+        _sqSize = _cqSize = std::max(_sqSize, _cqSize);
+
+    _sq = mmap(nullptr, _sqSize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (_sq == MAP_FAILED)
+        return false;
+
+    _cq = _sq;
+    if (!(_params.features & IORING_FEAT_SINGLE_MMAP))
+        _cq = mmap(nullptr, _cqSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+
+    _sqes = static_cast<io_uring_sqe *>(
+        mmap(nullptr, _params.sq_entries * sizeof(io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd,
+             IORING_OFF_SQES));
+
+    return _cq != MAP_FAILED && _sqes != MAP_FAILED;
+}
+
+io_uring_sqe *UringWriter::sqe()
+{
+    auto base = static_cast<char *>(_sq);
+    auto tail = reinterpret_cast<unsigned *>(base + _params.sq_off.tail);
+    auto mask = *reinterpret_cast<unsigned *>(base + _params.sq_off.ring_mask);
+    auto array = reinterpret_cast<unsigned *>(base + _params.sq_off.array);
+
+    auto index = *tail & mask;
+    array[index] = index;
+    __atomic_store_n(tail, *tail + 1, __ATOMIC_RELEASE);
+
+    auto sqe = &_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * Submits the count queued entries and waits for all of them, storing each
+ * result at the index kept in its user_data.
+ */
+void UringWriter::submit(unsigned count, std::vector<int> *results)
+{
+    for (unsigned submitted = 0; submitted < count;) {
+        auto ret = syscall(__NR_io_uring_enter, _fd, count - submitted,
+                           count - submitted, IORING_ENTER_GETEVENTS,
+                           nullptr, 0);
+        if (ret < 0 && errno != EINTR)
+            throw Exception("io_uring_enter failed");
+
+        if (ret > 0)
+            submitted += ret;
+    }
+
+    auto base = static_cast<char *>(_cq);
+    auto head = reinterpret_cast<unsigned *>(base + _params.cq_off.head);
+    auto tail = reinterpret_cast<unsigned *>(base + _params.cq_off.tail);
+    auto mask = *reinterpret_cast<unsigned *>(base + _params.cq_off.ring_mask);
+    auto cqes = reinterpret_cast<io_uring_cqe *>(base + _params.cq_off.cqes);
+
+    for (unsigned completed = 0; completed < count;) {
+        auto current = *head;
+        if (current == __atomic_load_n(tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, _fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                errno != EINTR)
+                throw Exception("io_uring_enter failed");
+
+            continue;
+        }
+
+        const auto &cqe = cqes[current & mask];
+        (*results)[cqe.user_data] = cqe.res;
+        __atomic_store_n(head, current + 1, __ATOMIC_RELEASE);
+        ++completed;
+    }
+}
+
+void UringWriter::write(std::vector<Pending *> *changed)
+{
+    auto entries = _sync ? _entries / 2 : _entries;
+
+    for (size_t first = 0; first < changed->size(); first += entries) {
+        auto count = std::min<size_t>(entries, changed->size() - first);
+        std::vector<int> fds(count), results(count * 2);
+
+        for (size_t i = 0; i < count; ++i) {
+            auto sqe = this->sqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(
+                (*changed)[first + i]->temp.c_str());
+            sqe->len = 0644;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            sqe->user_data = i;
+        }
+
+        submit(count, &fds);
+
+        unsigned queued = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (fds[i] < 0)
+                continue;
+
+            const auto &iov = (*changed)[first + i]->iov;
+
+            auto sqe = this->sqe();
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = fds[i];
+            sqe->addr = reinterpret_cast<uint64_t>(iov.data());
+            sqe->len = std::min<size_t>(iov.size(), IOV_MAX);
+            sqe->user_data = i * 2;
+            ++queued;
+
+            if (_sync) {
+                sqe->flags = IOSQE_IO_LINK;
+
+                sqe = this->sqe();
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = fds[i];
+                sqe->user_data = i * 2 + 1;
+                ++queued;
+            }
+        }
+
+        submit(queued, &results);
+
+        bool ok = true;
+        queued = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (fds[i] < 0) {
+                ok = false;
+                continue;
+            }
+
+            auto pending = (*changed)[first + i];
+
+            /*
+             * A short write breaks the link, its fsync then completes with
+             * -ECANCELED: the rest is written and synced here instead.
+             */
+            size_t size = pending->data.size();
+            bool partial = results[i * 2] >= 0 &&
+                           size_t(results[i * 2]) < size;
+            if (results[i * 2] < 0 ||
+                (_sync && !partial && results[i * 2 + 1] < 0))
+                ok = false;
+            else if (partial)
+                ok = writeAll(fds[i], pending->iov, results[i * 2]) &&
+                     (!_sync || fsync(fds[i]) == 0) && ok;
+
+            auto sqe = this->sqe();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fds[i];
+            sqe->user_data = i;
+            ++queued;
+        }
+
+        submit(queued, &results);
+        for (size_t i = 0; i < count; ++i)
+            ok = ok && (fds[i] < 0 || results[i] >= 0);
+
+        if (!ok)
+            throw Exception("Can't write the generated files");
+    }
+
+    for (size_t first = 0; first < changed->size(); first += _entries) {
+        auto count = std::min<size_t>(_entries, changed->size() - first);
+        std::vector<int> results(count);
+
+        for (size_t i = 0; i < count; ++i) {
+            auto pending = (*changed)[first + i];
+
+            auto sqe = this->sqe();
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(pending->temp.c_str());
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = reinterpret_cast<uint64_t>(pending->file.c_str());
+            sqe->user_data = i;
+            if (i + 1 < count)
+                sqe->flags = IOSQE_IO_LINK;
+        }
+
+        submit(count, &results);
+        for (size_t i = 0; i < count; ++i)
+            if (results[i] < 0)
+                throw Exception("Can't write " + (*changed)[first + i]->file);
+    }
+}
+
+class MKParser
+{
+    public:
+        static std::shared_ptr<Manifest>    _manifest;
+        static Manifest::Entry              *_entry;
+        static std::shared_ptr<TokenCache>  _tokenCache;
+        static std::shared_ptr<OutputCache> _outputCache;
+        static size_t                       _outputs;
+        static size_t                       _changed;
+        static bool                         _depfiles;
+        static std::shared_ptr<Writer>      _writer;
+
+        /*
+         * AUTOMAKE writes a Makefile.am per directory tied together with
+         * SUBDIRS. NON_RECURSIVE writes a single top level Makefile.am which
+         * includes a Makefrag.am per sub make, with every path and variable
+         * prefixed by its directory, so make sees the whole tree at once.
+         * NINJA does the same with build.ninja files, for ninja.
+         * MAKEFILE_IN writes what automake would make of the Makefile.am of
+         * AUTOMAKE, so configure can run without automake.
+         */
+        enum class Backend { AUTOMAKE, NON_RECURSIVE, NINJA, MAKEFILE_IN };
+
+        static Backend                      _backend;
+        static std::string                  _top;
+
+        /*
+         * The libraries the .mk files of a directory and its sub makes
+         * define and use. With _orderSubdirs, SUBDIRS lists the sub makes
+         * and . so that no directory comes before one it links from, and
+         * SUBDIRS_DEPS_DIR the ones each of them waits for.
+         */
+        struct Subtree
+        {
+            std::string              dir;
+            std::vector<std::string> defined;
+            std::vector<std::string> used;
+        };
+
+        static bool                         _orderSubdirs;
+        static Subtree                      *_subtree;
+        static std::vector<Subtree>         *_subdirs;
+
+        /*
+         * The outputs run in this pass, with what their subtree defines and
+         * uses, so that a sub make replayed from the manifest isn't run
+         * again when its parent has to be generated after all.
+         */
+        static std::unordered_map<std::string, Subtree> _done;
+
+        /*
+         * Whether some .mk of the tree sets compile options, which without
+         * recursion moves the addons of every Makefrag.am to a list of
+         * their own.
+         */
+        static bool                         _treeOptions;
+
+        /*
+         * Loaded into GNU make, see mk_parser_gmk_setup(): every .mk is
+         * included by make itself, whose MK_DIR prefixes the paths and
+         * variables of their functions, as without recursion, and these
+         * expand to what MAKEFILE_IN writes for them, see expand().
+         */
+        static bool                         _module;
+
+        /*
+         * A top level statement of a .mk file as it was last parsed. Kept
+         * only by the long running modes, see parseIncremental().
+         */
+        struct Statement
+        {
+            uint64_t                             hash;
+            bool                                 reusable;
+            BlockAST::Reads                      reads;
+            std::vector<std::shared_ptr<ExtAST>> nodes;
+            std::vector<std::pair<std::string, std::string>> libraries;
+            std::vector<BlockAST::Target>        targets;
+        };
+
+        static
+        std::shared_ptr<std::unordered_map<std::string,
+                                           std::vector<Statement>>>
+        _statements;
+
+        MKParser(const std::string &file,
+                 const std::vector<std::string> &subdirs = {});
+
+        void run(std::string output = "");
+        void validate();
+        bool scan();
+
+        static void regenerate(const std::string &file,
+                               const std::vector<std::string> &subdirs);
+
+        static std::string generator();
+        static std::string output(const std::string &dir);
+        static std::string summary();
+        static const Subtree &runSubMake(const std::string &file,
+                                         const std::string &output);
+        static std::string expand(const std::string &function,
+                                  const std::vector<std::string> &args,
+                                  const std::string &dir);
+    private:
+        SubMakesAST              _subMakes;
+        BlockAST                 _root;
+        mutable char             _lastChar = 0;
+        std::string              _file;
+        std::string              _dir;
+        mutable BlockAST::Shared _shared;
+
+        /*
+         * With _writer, the manifest entries of the outputs it holds, only
+         * recorded once they are on disk.
+         */
+        static std::vector<std::pair<std::string, Manifest::Entry>> _unflushed;
+
+        /*
+         * With _module, the compile options the .mk files set, by MK_DIR
+         * and file. A target can be expanded before the options of its
+         * sources are set, so they're only applied to the objects by the
+         * rules that follow every call.
+         */
+        static std::map<std::string, std::vector<std::string>>
+        _moduleOptions;
+
+        std::deque<Token> lexer() const;
+        std::deque<Token> lexer(std::istream &is) const;
+        Token nextToken(std::istream &is) const;
+
+        static std::vector<std::string> split(const std::string &text);
+        void parseIncremental();
+
+        uint64_t contentHash() const;
+        uint64_t inputHash() const;
+        std::string needed() const;
+        bool addonList() const;
+        void replay(const Manifest::Entry &entry) const;
+        static void runSubMakes(const Manifest::Entry &entry);
+        static uint64_t subtreeHash(const Manifest::Entry &entry);
+        void writeDepfile(const std::string &output,
+                          const Manifest::Entry &entry) const;
+
+        void codeGen(Output &out) const;
+        void subdirsGen(Output &out,
+                        const std::vector<Subtree> &subdirs) const;
+
+        static void collect(const Manifest::Entry &entry);
+        static void defined(const Manifest::Entry &entry,
+                            std::vector<std::string> *names);
+        static std::vector<std::string> substitutions();
+};
+
+std::shared_ptr<Manifest>    MKParser::_manifest;
+Manifest::Entry              *MKParser::_entry = nullptr;
+std::shared_ptr<TokenCache>  MKParser::_tokenCache;
+std::shared_ptr<OutputCache> MKParser::_outputCache;
+size_t                       MKParser::_outputs = 0;
+size_t                       MKParser::_changed = 0;
+bool                         MKParser::_depfiles = false;
+std::shared_ptr<Writer>      MKParser::_writer;
+std::vector<std::pair<std::string, Manifest::Entry>> MKParser::_unflushed;
+std::map<std::string, std::vector<std::string>> MKParser::_moduleOptions;
+MKParser::Backend            MKParser::_backend = MKParser::Backend::AUTOMAKE;
+std::string                  MKParser::_top;
+bool                         MKParser::_orderSubdirs = false;
+MKParser::Subtree            *MKParser::_subtree = nullptr;
+std::vector<MKParser::Subtree> *MKParser::_subdirs = nullptr;
+std::unordered_map<std::string, MKParser::Subtree> MKParser::_done;
+bool                         MKParser::_treeOptions = false;
+bool                         MKParser::_module = false;
+
+std::shared_ptr<std::unordered_map<std::string,
+                                   std::vector<MKParser::Statement>>>
+MKParser::_statements;
+
+MKParser::MKParser(const std::string &file,
+                   const std::vector<std::string> &subdirs)
+    : _subMakes(subdirs, file.substr(0, file.find_last_of("/")) + "/"),
+      _root(file), _file(file)
+{
+    auto dir = file.substr(0, file.find_last_of("/") + 1);
+    if (_backend != Backend::AUTOMAKE)
+        _dir = dir.compare(0, _top.size(), _top) == 0 ? dir.substr(_top.size())
+                                                      : dir;
+}
+
+/*
+ * What goes into the hashes of the outputs, so switching backends never
+ * reuses what another one generated.
+ */
+std::string MKParser::generator()
+{
+    std::string generator = MK_PARSER_VERSION;
+    if (_backend == Backend::NON_RECURSIVE)
+        generator += " non-recursive";
+    else if (_backend == Backend::NINJA)
+        generator += " ninja";
+    else if (_backend == Backend::MAKEFILE_IN)
+        generator += " makefile-in";
+
+    if (BlockAST::_unitySize)
+        generator += " unity " + std::to_string(BlockAST::_unitySize);
+
+    if (BlockAST::_pch)
+        generator += BlockAST::_inferPch ? " pch infer" : " pch";
+
+    if (BlockAST::_shareSources)
+        generator += " shared sources";
+
+    if (_orderSubdirs)
+        generator += " ordered subdirs";
+
+    if (!BlockAST::_prunedIf.empty())
+        generator += " pruned if " + BlockAST::_prunedIf;
+
+    if (BlockAST::_reduceLinks)
+        generator += " reduced links";
+
+    if (BlockAST::_parallelTests)
+        generator += " parallel tests " + std::to_string(BlockAST::_testShards);
+
+    return generator;
+}
+
+/*
+ * The file generated for the .mk of dir (with a trailing /).
+ */
+std::string MKParser::output(const std::string &dir)
+{
+    if (_backend == Backend::NINJA)
+        return dir + "build.ninja";
+
+    if (_backend == Backend::MAKEFILE_IN)
+        return dir + "Makefile.in";
+
+    if (_backend == Backend::NON_RECURSIVE && dir != _top)
+        return dir + "Makefrag.am";
+
+    return dir + "Makefile.am";
+}
+
+/*
+ * How many of the outputs the last pass wrote changed.
+ */
+std::string MKParser::summary()
+{
+    std::string kind = "Makefile.am";
+    if (_backend == Backend::NON_RECURSIVE)
+        kind = "Makefile.am and Makefrag.am";
+    else if (_backend == Backend::NINJA)
+        kind = "build.ninja";
+    else if (_backend == Backend::MAKEFILE_IN)
+        kind = "Makefile.in";
+
+    return std::to_string(_changed) + " of " + std::to_string(_outputs) + " "
+           + kind + " files changed";
+}
+
+void MKParser::run(std::string output)
+{
+    if (output.empty())
+        output = MKParser::output(_file.substr(0,
+                                               _file.find_last_of("/") + 1));
+
+    ++_outputs;
+
+    Manifest::Entry entry;
+    if (_manifest) {
+        entry.inputHash = inputHash();
+
+        auto previous = _manifest->find(output);
+        if (previous && previous->inputHash == entry.inputHash &&
+            std::ifstream(output)) {
+            replay(*previous);
+            runSubMakes(*previous);
+            if (previous->libraryHash ==
+                BlockAST::libraryHash(previous->usedLibraries) &&
+                previous->subtreeHash == subtreeHash(*previous)) {
+                writeDepfile(output, *previous);
+                collect(*previous);
+                return;
+            }
+        }
+    }
+
+    std::deque<Token> tokens;
+    if (_outputCache || !_statements)
+        tokens = lexer();
+
+    Buffer code;
+    bool cached = false;
+    uint64_t key = 0;
+    if (_outputCache) {
+        key = _outputCache->key(generator() + needed(), _file, tokens,
+                                _root.attributesHash(), _subMakes.subDirs());
+
+        /*
+         * The output looked up depends on the libraries the sub makes
+         * register, so they run first. On a miss, codegen doesn't run them
+         * again, see runSubMake().
+         */
+        Manifest::Entry index;
+        std::string text;
+        if (_outputCache->findEntry(key, &index)) {
+            replay(index);
+            runSubMakes(index);
+            index.subtreeHash = subtreeHash(index);
+            if (_outputCache->fetch(key, index, &text)) {
+                index.inputHash = entry.inputHash;
+                entry = index;
+                code << text;
+                cached = true;
+            }
+        }
+    }
+
+    BlockAST::forgetTargets(_file);
+    if (cached)
+        for (const auto &target : entry.targets)
+            BlockAST::_targets[target.name] = target;
+    else {
+        auto parent = _entry;
+        auto prefix = BlockAST::_prefix;
+        auto shared = BlockAST::_shared;
+        auto addons = BlockAST::_addonList;
+        _entry = &entry;
+        BlockAST::_prefix = _backend == Backend::MAKEFILE_IN ? "" : _dir;
+        BlockAST::_shared = &_shared;
+
+        if (_statements)
+            parseIncremental();
+        else
+            _root.parse(&tokens);
+
+        BlockAST::_addonList = addonList();
+        codeGen(code);
+
+        _entry = parent;
+        BlockAST::_prefix = prefix;
+        BlockAST::_shared = shared;
+        BlockAST::_addonList = addons;
+
+        entry.subtreeHash = subtreeHash(entry);
+        if (_outputCache)
+            _outputCache->store(key, entry, code.str());
+    }
+
+    if (_writer)
+        _writer->add(output, std::move(code));
+    else if (writeFileIfChanged(output, code.iov()))
+        ++_changed;
+
+    writeDepfile(output, entry);
+    collect(entry);
+
+    if (_manifest) {
+        entry.libraryHash = BlockAST::libraryHash(entry.usedLibraries);
+        if (_writer)
+            _unflushed.emplace_back(output, entry);
+        else
+            _manifest->update(output, entry);
+    }
+}
+
+/*
+ * Adds what entry defines that others can depend on: its libraries and its
+ * node.js addons.
+ */
+void MKParser::defined(const Manifest::Entry &entry,
+                       std::vector<std::string> *names)
+{
+    for (const auto &library : entry.libraries)
+        names->push_back(library.first);
+
+    for (const auto &target : entry.targets)
+        if (target.type == "nodejs_addon")
+            names->push_back(target.name);
+}
+
+/*
+ * Adds the libraries entry defines and uses to the sub make being run.
+ */
+void MKParser::collect(const Manifest::Entry &entry)
+{
+    if (!_subtree)
+        return;
+
+    defined(entry, &_subtree->defined);
+    _subtree->used.insert(_subtree->used.end(), entry.usedLibraries.begin(),
+                          entry.usedLibraries.end());
+}
+
+/*
+ * Writes SUBDIRS in an order where every directory comes after the ones
+ * defining libraries or addons it uses, keeping the order of the .mk
+ * otherwise, and what each waits for. A cycle, which only . can be part of,
+ * can't be built by any order.
+ */
+void MKParser::subdirsGen(Output &out,
+                          const std::vector<Subtree> &subdirs) const
+{
+    if (subdirs.empty())
+        return;
+
+    auto nodes = subdirs;
+    nodes.push_back({ ".", {}, {} });
+    if (_entry) {
+        defined(*_entry, &nodes.back().defined);
+        nodes.back().used = _entry->usedLibraries;
+    }
+
+    std::vector<std::vector<size_t>> dependencies(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i)
+        for (size_t j = 0; j < nodes.size(); ++j) {
+            if (i == j)
+                continue;
+
+            for (const auto &used : nodes[i].used)
+                if (std::find(nodes[j].defined.begin(), nodes[j].defined.end(),
+                              used) != nodes[j].defined.end()) {
+                    dependencies[i].push_back(j);
+                    break;
+                }
+        }
+
+    std::vector<bool> done(nodes.size());
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        size_t i = 0;
+        for (; i < nodes.size(); ++i) {
+            if (done[i])
+                continue;
+
+            bool ready = true;
+            for (auto j : dependencies[i])
+                ready = ready && done[j];
+
+            if (ready)
+                break;
+        }
+
+        if (i == nodes.size())
+            throw Exception("Sub makes of " + _file + " depend on each "
+                            "other's libraries");
+
+        done[i] = true;
+        out << "SUBDIRS += " << nodes[i].dir << "\n";
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (dependencies[i].empty())
+            continue;
+
+        auto name = nodes[i].dir;
+        for (auto &c : name)
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '_')
+                c = '_';
+
+        out << "\nSUBDIRS_DEPS_" << name << " =";
+        for (auto j : dependencies[i])
+            out << " " << nodes[j].dir;
+    }
+
+    out << "\n";
+}
+
+uint64_t MKParser::contentHash() const
+{
+    return hashString(readFile(_file), hashString(generator()));
+}
+
+/*
+ * The targets of the .mk kept with _roots and, without recursion, whether
+ * the tree sets compile options: both can change with a change anywhere in
+ * the tree.
+ */
+std::string MKParser::needed() const
+{
+    auto options = _backend == Backend::NON_RECURSIVE && _treeOptions
+                   ? std::string(" options") : std::string();
+    if (BlockAST::_roots.empty())
+        return options;
+
+    std::vector<std::string> needed;
+    for (const auto &target : BlockAST::_targets)
+        if (target.second.file == _file && BlockAST::_needed.count(target.first))
+            needed.push_back(target.first);
+
+    std::sort(needed.begin(), needed.end());
+    return options + " needed " + join(needed, " ");
+}
+
+/*
+ * Addons need a list of their own as soon as convenience libraries get built
+ * next to them: with --share-sources, or for the sources with compile options
+ * of this Makefile.am or, without recursion, of the whole tree.
+ */
+bool MKParser::addonList() const
+{
+    if (BlockAST::_shareSources)
+        return true;
+
+    if (_backend == Backend::NON_RECURSIVE)
+        return _treeOptions;
+
+    std::map<std::string, std::vector<std::string>> options;
+    _root.compileOptions(&options);
+    return !options.empty();
+}
+
+uint64_t MKParser::inputHash() const
+{
+    auto hash = hashString(needed(), contentHash());
+    hash = hashString(join(_subMakes.subDirs(), " "), hash);
+    return hashString(std::to_string(_root.attributesHash()), hash);
+}
+
+/*
+ * Parses without generating anything and without leaving the libraries or
+ * targets it defines behind.
+ */
+void MKParser::validate()
+{
+    auto libraryMap = BlockAST::_libraryMap;
+    auto targets = BlockAST::_targets;
+
+    try {
+        std::deque<Token> tokens = lexer();
+        _root.parse(&tokens);
+    } catch (...) {
+        BlockAST::_libraryMap = libraryMap;
+        BlockAST::_targets = targets;
+        throw;
+    }
+
+    BlockAST::_libraryMap = libraryMap;
+    BlockAST::_targets = targets;
+}
+
+/*
+ * Parses the .mk and, recursively, those of its sub makes, only to
+ * register their targets.
+ */
+bool MKParser::scan()
+{
+    BlockAST::forgetTargets(_file);
+
+    std::deque<Token> tokens = lexer();
+    _root.parse(&tokens);
+
+    std::map<std::string, std::vector<std::string>> options;
+    _root.compileOptions(&options);
+
+    std::vector<std::string> files;
+    _subMakes.subMakes(&files);
+    _root.subMakes(&files);
+
+    bool found = !options.empty();
+    for (const auto &file : files) {
+        MKParser parser(file);
+        found = parser.scan() || found;
+    }
+
+    return found;
+}
+
+/*
+ * What a call of function from a .mk of dir expands to, its arguments
+ * already expanded by make, or with no function the rules that follow
+ * every call. A sub make expands to its include, MK_DIR set to its
+ * directory around it.
+ */
+std::string MKParser::expand(const std::string &function,
+                             const std::vector<std::string> &args,
+                             const std::string &dir)
+{
+    Buffer code;
+    if (function.empty()) {
+        MKParser parser("");
+        parser.codeGen(code);
+        return code.str();
+    }
+
+    MKParser parser((dir.empty() ? "./" : dir) + "Makefile");
+    BlockAST::_prefix = dir;
+
+    std::string text = "$(eval $(call " + function;
+    for (const auto &arg : args)
+        text += "," + arg;
+
+    std::istringstream is(text + "))\n");
+    auto tokens = parser.lexer(is);
+    parser._root.parse(&tokens);
+
+    std::map<std::string, std::vector<std::string>> options;
+    parser._root.compileOptions(&options);
+    for (const auto &option : options) {
+        auto &o = _moduleOptions[dir + option.first];
+        o.insert(o.end(), option.second.begin(), option.second.end());
+    }
+
+    std::vector<std::string> files;
+    parser._root.subMakes(&files);
+    if (files.empty()) {
+        parser.codeGen(code);
+        return code.str();
+    }
+
+    for (auto file : files) {
+        if (file.compare(0, 2, "./") == 0)
+            file = file.substr(2);
+
+        code << "MK_DIR := " << file.substr(0, file.find_last_of("/") + 1)
+             << "\ninclude " << file << "\n";
+    }
+
+    code << "MK_DIR := " << dir << "\n";
+    return code.str();
+}
+
+/*
+ * One pass over the whole tree, starting again from the built-in libraries
+ * so that libraries dropped from a .mk don't linger between passes.
+ */
+void MKParser::regenerate(const std::string &file,
+                          const std::vector<std::string> &subdirs)
+{
+    BlockAST::_libraryMap = BlockAST::_builtinLibraryMap;
+    _outputs = _changed = 0;
+    _subtree = nullptr;
+    _subdirs = nullptr;
+    _done.clear();
+    _unflushed.clear();
+    _top = file.substr(0, file.find_last_of("/") + 1);
+    _treeOptions = false;
+
+    if (!BlockAST::_roots.empty()) {
+        _treeOptions = MKParser(file, subdirs).scan();
+        BlockAST::_libraryMap = BlockAST::_builtinLibraryMap;
+        BlockAST::findNeeded();
+    }
+    else if (_backend == Backend::NON_RECURSIVE && !BlockAST::_shareSources) {
+        _treeOptions = MKParser(file, subdirs).scan();
+        BlockAST::_libraryMap = BlockAST::_builtinLibraryMap;
+    }
+
+    MKParser parser(file, subdirs);
+    parser.run();
+
+    if (_writer) {
+        _changed += _writer->flush();
+        for (const auto &unflushed : _unflushed)
+            _manifest->update(unflushed.first, unflushed.second);
+
+        _unflushed.clear();
+    }
+
+    if (_manifest) {
+        std::unordered_set<std::string> visited = { output(_top) };
+        for (const auto &done : _done)
+            visited.insert(done.first);
+
+        _manifest->retain(visited);
+        _manifest->save();
+    }
+}
+
+/*
+ * Writes output.d, a make dependency fragment listing every .mk the output
+ * was generated from: its own, the ones of its sub makes (transitively) and
+ * the ones defining the libraries it resolved. Its target is output.d
+ * itself, touched on every run, since an output whose content didn't change
+ * keeps its mtime and would look out of date for good.
+ */
+void MKParser::writeDepfile(const std::string &output,
+                            const Manifest::Entry &entry) const
+{
+    static std::unordered_map<std::string, std::vector<std::string>> depends;
+
+    if (!_depfiles)
+        return;
+
+    std::vector<std::string> files = { _file };
+    auto add = [&files](const std::string &file) {
+        if (std::find(files.begin(), files.end(), file) == files.end())
+            files.push_back(file);
+    };
+
+    for (const auto &subMake : entry.subMakes)
+        for (const auto &file : depends[subMake.second])
+            add(file);
+
+    for (const auto &name : entry.usedLibraries) {
+        auto t = BlockAST::_targets.find(name);
+        if (t != BlockAST::_targets.end() &&
+            (t->second.type == "library" || t->second.type == "nodejs_addon"))
+            add(t->second.file);
+    }
+
+    depends[output] = files;
+
+    std::string depfile = output + ".d: \\\n  " + join(files, " \\\n  ")
+                          + "\n\n";
+    for (const auto &file : files)
+        depfile += file + ":\n";
+
+    if (!writeFileIfChanged(output + ".d", depfile))
+        utimensat(AT_FDCWD, (output + ".d").c_str(), nullptr, 0);
+}
+
+void MKParser::replay(const Manifest::Entry &entry) const
+{
+    for (const auto &library : entry.libraries)
+        BlockAST::_libraryMap[library.first].first = library.second;
+
+    for (const auto &target : entry.targets)
+        BlockAST::_targets[target.name] = target;
+}
+
+void MKParser::runSubMakes(const Manifest::Entry &entry)
+{
+    for (const auto &subMake : entry.subMakes)
+        runSubMake(subMake.first, subMake.second);
+}
+
+/*
+ * What the sub makes of entry, already run, define and use. Only SUBDIRS
+ * ordered by _orderSubdirs depends on it.
+ */
+uint64_t MKParser::subtreeHash(const Manifest::Entry &entry)
+{
+    if (!_orderSubdirs)
+        return 0;
+
+    auto hash = hashString("");
+    for (const auto &subMake : entry.subMakes) {
+        const auto &subtree = _done.at(subMake.second);
+
+        hash = hashString(subMake.second + '\0', hash);
+        hash = hashString(join(subtree.defined, " ") + '\0', hash);
+        hash = hashString(join(subtree.used, " ") + '\0', hash);
+    }
+
+    return hash;
+}
+
+/*
+ * Runs the sub make file into output, unless it already ran in this pass,
+ * adding what its subtree defines and uses to the sub make being run.
+ */
+const MKParser::Subtree &MKParser::runSubMake(const std::string &file,
+                                              const std::string &output)
+{
+    auto done = _done.find(output);
+    if (done == _done.end()) {
+        Subtree subtree;
+        auto parent = _subtree;
+        _subtree = &subtree;
+
+        MKParser parser(file);
+        try {
+            parser.run(output);
+        } catch (...) {
+            _subtree = parent;
+            throw;
+        }
+
+        _subtree = parent;
+        done = _done.emplace(output, std::move(subtree)).first;
+    }
+
+    if (_subtree) {
+        _subtree->defined.insert(_subtree->defined.end(),
+                                 done->second.defined.begin(),
+                                 done->second.defined.end());
+        _subtree->used.insert(_subtree->used.end(), done->second.used.begin(),
+                              done->second.used.end());
+    }
+
+    return done->second;
+}
+
+void BlockAST::codeGen(Output &out, size_t begin, size_t end) const
+{
+    std::vector<Chunk> chunks((end - begin + _chunkNodes - 1) / _chunkNodes);
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < chunks.size();) {
+            _chunk = &chunks[i];
+            try {
+                auto last = std::min(end, begin + (i + 1) * _chunkNodes);
+                for (auto j = begin + i * _chunkNodes; j < last; ++j)
+                    nodeGen(*_AST[j], chunks[i].code);
+            } catch (...) {
+                chunks[i].error = std::current_exception();
+            }
+
+            _chunk = nullptr;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min<size_t>(_jobs, chunks.size()); ++i)
+        threads.emplace_back(worker);
+
+    worker();
+    for (auto &thread : threads)
+        thread.join();
+
+    for (auto &chunk : chunks) {
+        if (chunk.error)
+            std::rethrow_exception(chunk.error);
+
+        for (const auto &iov : chunk.code.iov())
+            out.write(static_cast<const char *>(iov.iov_base), iov.iov_len);
+
+        for (const auto &name : chunk.usedLibraries)
+            useLibrary(MKParser::_entry ? &MKParser::_entry->usedLibraries
+                                        : nullptr, name);
+
+        if (_goals) {
+            _goals->all.insert(_goals->all.end(), chunk.goals.all.begin(),
+                               chunk.goals.all.end());
+            _goals->check.insert(_goals->check.end(),
+                                 chunk.goals.check.begin(),
+                                 chunk.goals.check.end());
+        }
+
+        std::cout << chunk.unresolved.str();
+        std::cerr << chunk.reductions.str();
+    }
+}
+
+/*
+ * Writes the rules building stem-pch.h.gch with flags and adds what makes
+ * the objects of the target use it to cxxFlags. stem-pch.h includes header
+ * or, without one, the includes of other directories found in at least
+ * half of the sources. Returns whether the target has one.
+ */
+bool BlockAST::pchGen(Output &out, const std::string &variable,
+                      const std::string &stem,
+                      const std::vector<std::string> &sources,
+                      const std::string &header,
+                      const std::vector<std::string> &flags,
+                      std::vector<std::string> *cxxFlags)
+{
+    if (!_pch || (header.empty() && !_inferPch))
+        return false;
+
+    auto pch = stem + "-pch.h";
+
+    out << variable << "_PCH = " << pch << ".gch\n\n";
+
+    if (!header.empty())
+        out << pch << ": Makefile\n"
+            << "\t$(AM_V_GEN)echo '#include \"$(abs_srcdir)/" << path(header)
+            << "\"' > $@-t && \\\n";
+    else {
+        out << pch << ":";
+        for (const auto &source : sources)
+            out << " " << path(source);
+
+        out << "\n\t$(AM_V_GEN)grep -h -E '^[[:space:]]*#[[:space:]]*include"
+               "[[:space:]]*(<|\"[^\"]*/)' $^ | \\\n"
+            << "\t  awk '{ if (!($$0 in n)) l[++k] = $$0; ++n[$$0] } "
+               "END { for (i = 1; i <= k; ++i) if (2 * n[l[i]] >= "
+            << std::to_string(sources.size()) << ") print l[i] }' "
+               "> $@-t && \\\n";
+    }
+
+    out << "\t  { cmp -s $@-t $@ && rm -f $@-t || mv -f $@-t $@; }\n\n";
+
+    out << pch << ".gch: " << pch << "\n"
+        << "\t$(AM_V_CXX)$(CXX) $(DEFS) $(DEFAULT_INCLUDES) $(INCLUDES) "
+           "$(AM_CPPFLAGS) $(CPPFLAGS)";
+    for (const auto &flag : flags)
+        out << " " << flag;
+
+    out << " $(CXXFLAGS) -x c++-header -o $@ " << pch << "\n\n";
+    out << "CLEANFILES += " << pch << " " << pch << ".gch\n\n";
+
+    if (MKParser::_backend != MKParser::Backend::MAKEFILE_IN)
+        out << "$(" << variable << "_OBJECTS): $(" << variable << "_PCH)\n\n";
+
+    cxxFlags->push_back("-include " + pch);
+    cxxFlags->push_back("-Winvalid-pch");
+    return true;
+}
+
+/*
+ * Takes the sources with compile options out of sources. If none would be
+ * left, the first group stays, with its options in options.
+ */
+BlockAST::OptionGroups
+BlockAST::optionGroups(std::vector<std::string> *sources,
+                       std::vector<std::string> *options)
+{
+    OptionGroups groups;
+    std::vector<std::string> plain;
+    for (const auto &source : *sources) {
+        auto o = sourceOptions(source);
+        if (!o) {
+            plain.push_back(source);
+            continue;
+        }
+
+        auto group = std::find_if(groups.begin(), groups.end(),
+                                  [&](const OptionGroups::value_type &g) {
+            return g.first == *o;
+        });
+
+        if (group == groups.end())
+            groups.emplace_back(*o, std::vector<std::string>{ source });
+        else
+            group->second.push_back(source);
+    }
+
+    if (plain.empty() && !groups.empty()) {
+        plain = groups.front().second;
+        *options = groups.front().first;
+        groups.erase(groups.begin());
+    }
+
+    *sources = plain;
+    return groups;
+}
+
+/*
+ * Writes the convenience libraries libstem_optN.la building each group
+ * with cxxFlags and its options.
+ */
+void BlockAST::optionsGen(Output &out, const std::string &stem,
+                          const OptionGroups &groups,
+                          const std::vector<std::string> &cxxFlags)
+{
+    for (size_t i = 0; i < groups.size(); ++i) {
+        auto library = "lib" + stem + "_opt" + std::to_string(i + 1);
+        auto name = variable(library) + "_la";
+
+        out << "noinst_LTLIBRARIES += " << path(library) << ".la\n\n";
+        sourcesGen(out, name, path(library), groups[i].second, {});
+        out << "\n\n";
+
+        auto flags = cxxFlags;
+        ownOptionsGen(out, name, groups[i].first, &flags);
+
+        if (!flags.empty()) {
+            out << name << "_CXXFLAGS = \\\n  ";
+            join(out, flags, " \\\n  ");
+            out << "\n\n";
+        }
+    }
+}
+
+/*
+ * automake puts the CXXFLAGS of the user after those of the targets, so
+ * options come last by being added to CXXFLAGS for the objects of the
+ * target, which cxxFlags then keeps apart from those of other targets, or
+ * in Makefile.in by variable_OPTIONS.
+ */
+void BlockAST::ownOptionsGen(Output &out, const std::string &variable,
+                             const std::vector<std::string> &options,
+                             std::vector<std::string> *cxxFlags)
+{
+    if (options.empty())
+        return;
+
+    if (MKParser::_backend == MKParser::Backend::MAKEFILE_IN) {
+        out << variable << "_OPTIONS = " << join(options, " ") << "\n\n";
+        return;
+    }
+
+    out << "$(" << variable << "_OBJECTS): CXXFLAGS += " << join(options, " ")
+        << "\n\n";
+
+    if (cxxFlags->empty())
+        cxxFlags->push_back("$(AM_CXXFLAGS)");
+}
+
+/*
+ * Finds the targets _roots link with, following the dependencies of the
+ * whole tree as MKParser::scan() registered them.
+ */
+void BlockAST::findNeeded()
+{
+    _needed.clear();
+
+    std::function<void (const std::string &)> visit;
+    visit = [&](const std::string &name) {
+        auto t = _targets.find(name);
+        if (t == _targets.end() || !_needed.insert(name).second)
+            return;
+
+        for (const auto &dependency : t->second.dependencies)
+            visit(dependency);
+    };
+
+    for (const auto &root : _roots) {
+        if (root.compare(0, 5, "type=") != 0) {
+            if (!_targets.count(root))
+                throw Exception("Unknown root target " + root);
+
+            visit(root);
+            continue;
+        }
+
+        auto type = root.substr(5);
+        for (const auto &target : _targets) {
+            const auto &t = target.second.type;
+            if (t == type || (type == "tests" && t.size() >= 4 &&
+                              t.compare(t.size() - 4, 4, "test") == 0))
+                visit(target.first);
+        }
+    }
+}
+
+/*
+ * The tests that link, directly or not, with a target built from one of
+ * files, or defined in one of them, as TESTS lists them from the directory
+ * top. A file of no target, a header say, stands for the targets of the
+ * sources that included it when they were last compiled, as the .deps
+ * directories next to the .mk files tell, and for every target when they
+ * don't know it. Relative files are taken from top.
+ */
+std::vector<std::string>
+BlockAST::impactedTests(const std::string &top,
+                        const std::vector<std::string> &files)
+{
+    auto cwd = currentDir();
+    auto root = absolutePath(top, cwd);
+
+    std::unordered_map<std::string, std::vector<std::string>> owners, defined,
+                                                              dependents;
+    std::vector<std::string> all;
+    for (const auto &target : _targets) {
+        const auto &t = target.second;
+        auto file = absolutePath(t.file, cwd);
+        auto dir = file.substr(0, file.find_last_of('/'));
+
+        for (const auto &source : t.sources)
+            owners[absolutePath(source, dir)].push_back(t.name);
+
+        defined[file].push_back(t.name);
+        all.push_back(t.name);
+
+        for (const auto &dependency : t.dependencies)
+            dependents[dependency].push_back(t.name);
+    }
+
+    /*
+     * The first prerequisite of the rule of a dependency file is the
+     * source, the others what it included.
+     */
+    std::unordered_map<std::string, std::vector<std::string>> included;
+    std::unordered_set<std::string> scanned;
+    for (const auto &target : _targets) {
+        auto file = absolutePath(target.second.file, cwd);
+        auto dir = file.substr(0, file.find_last_of('/'));
+        if (!scanned.insert(dir).second)
+            continue;
+
+        auto deps = opendir((dir + "/.deps").c_str());
+        if (!deps)
+            continue;
+
+        while (auto entry = readdir(deps)) {
+            std::string name(entry->d_name);
+            auto extension = name.substr(std::min(name.find_last_of('.'),
+                                                  name.size()));
+            if (extension != ".Plo" && extension != ".Po")
+                continue;
+
+            std::istringstream rules(replaceAll(readFile(dir + "/.deps/"
+                                                         + name),
+                                                "\\\n", " "));
+            for (std::string line; std::getline(rules, line);) {
+                auto colon = line.find(':');
+                if (line.empty() || line[0] == '#' ||
+                    colon == std::string::npos)
+                    continue;
+
+                std::istringstream prerequisites(line.substr(colon + 1));
+                std::string source;
+                prerequisites >> source;
+
+                auto o = owners.find(absolutePath(source, dir));
+                if (o != owners.end())
+                    for (std::string header; prerequisites >> header;) {
+                        auto &names = included[absolutePath(header, dir)];
+                        names.insert(names.end(), o->second.begin(),
+                                     o->second.end());
+                    }
+
+                break;
+            }
+        }
+
+        closedir(deps);
+    }
+
+    std::vector<std::string> pending;
+    for (const auto &f : files) {
+        auto file = absolutePath(f, root);
+
+        const std::vector<std::string> *names = &all;
+        for (const auto *map : { &owners, &included, &defined }) {
+            auto it = map->find(file);
+            if (it != map->end()) {
+                names = &it->second;
+                break;
+            }
+        }
+
+        pending.insert(pending.end(), names->begin(), names->end());
+    }
+
+    std::unordered_set<std::string> impacted;
+    while (!pending.empty()) {
+        auto name = pending.back();
+        pending.pop_back();
+        if (!impacted.insert(name).second)
+            continue;
+
+        auto d = dependents.find(name);
+        if (d != dependents.end())
+            pending.insert(pending.end(), d->second.begin(), d->second.end());
+    }
+
+    auto prefix = root == "/" ? root : root + "/";
+
+    std::vector<std::string> tests;
+    for (const auto &name : impacted) {
+        const auto &t = _targets.at(name);
+        if (t.type.size() < 4 || t.type.compare(t.type.size() - 4, 4, "test"))
+            continue;
+
+        auto file = absolutePath(t.file, cwd);
+        auto dir = file.substr(0, file.find_last_of('/') + 1);
+        if (dir.compare(0, prefix.size(), prefix) == 0)
+            dir.erase(0, prefix.size());
+
+        tests.push_back(dir + (t.type == "test" ? t.name : t.sources.at(0)));
+    }
+
+    std::sort(tests.begin(), tests.end());
+    return tests;
+}
+
+/*
+ * Generates node unless it's a target nothing in _roots needs.
+ */
+void BlockAST::nodeGen(const ExtAST &node, Output &out)
+{
+    auto target = node.target();
+    if (_roots.empty() || target.empty() || _needed.count(target)) {
+        node.codeGen(out);
+        return;
+    }
+
+    if (_prunedIf.empty() ||
+        MKParser::_backend == MKParser::Backend::NINJA)
+        return;
+
+    Buffer block;
+    node.codeGen(block);
+
+    if (MKParser::_backend == MKParser::Backend::MAKEFILE_IN) {
+        std::istringstream is(block.str());
+        std::string line;
+        while (std::getline(is, line))
+            out << (line.empty() ? "" : "@" + _prunedIf + "_TRUE@") << line
+                << "\n";
+    }
+    else
+        out << "if " << _prunedIf << "\n" << block.str() << "endif\n\n";
+}
+
+void BlockAST::useLibrary(std::vector<std::string> *used,
+                          const std::string &name)
+{
+    if (used && std::find(used->begin(), used->end(), name) == used->end())
+        used->push_back(name);
+}
+
+const std::pair<std::string, std::string> *
+BlockAST::resolveLibrary(const std::string &name)
+{
+    if (_chunk)
+        useLibrary(&_chunk->usedLibraries, name);
+    else if (MKParser::_entry)
+        useLibrary(&MKParser::_entry->usedLibraries, name);
+
+    auto t = _libraryMap.find(name);
+    return t == _libraryMap.end() ? nullptr : &t->second;
+}
+
+/*
+ * Writes dependencies resolved through _libraryMap, one per line. Without
+ * cxxFlags, unresolved dependencies are reported instead of collecting the
+ * flags of resolved ones.
+ */
+void BlockAST::dependenciesGen(Output &out,
+                               const std::vector<std::string> &dependencies,
+                               std::vector<std::string> *cxxFlags)
+{
+    for (const auto &dependency : dependencies) {
+        if (&dependency != &dependencies[0])
+            out << " \\\n  ";
+
+        auto t = resolveLibrary(dependency);
+        if (!t) {
+            out << dependency;
+            if (!cxxFlags && _chunk)
+                _chunk->unresolved << dependency << "\n";
+            else if (!cxxFlags)
+                std::cout << dependency << std::endl;
+
+            continue;
+        }
+
+        out << t->first;
+        if (cxxFlags && !t->second.empty())
+            cxxFlags->push_back(t->second);
+    }
+}
+
+/*
+ * Collects the compile options of the block and writes a convenience
+ * library for each set of sources compiled with the same flags by the same
+ * programs and libraries of the block, and tells them in shared. A target
+ * never gives up all of its sources, as automake would then make up one,
+ * and keeps those with compile options.
+ */
+void BlockAST::shareSources(Output &out, Shared *shared) const
+{
+    shared->targets.clear();
+    shared->options.clear();
+    compileOptions(&shared->options);
+
+    if (!_shareSources || MKParser::_backend == MKParser::Backend::NINJA)
+        return;
+
+    struct Consumer
+    {
+        const ExtAST             *node;
+        std::vector<std::string> sources;
+        std::vector<std::string> flags;
+        std::vector<std::string> unityExclude;
+        bool                     active;
+    };
+
+    std::vector<Consumer> consumers;
+    for (const auto &element : _AST) {
+        Consumer consumer{ element.get(), {}, {}, {}, true };
+        std::vector<std::string> dependencies;
+        if (!element->compiles(&consumer.sources, &dependencies,
+                               &consumer.unityExclude))
+            continue;
+
+        consumer.sources.erase(std::remove_if(consumer.sources.begin(),
+                                              consumer.sources.end(),
+                                              [&](const std::string &source) {
+            return shared->options.count(source);
+        }), consumer.sources.end());
+
+        Buffer ignored;
+        dependenciesGen(ignored, dependencies, &consumer.flags);
+        consumers.push_back(std::move(consumer));
+    }
+
+    typedef std::pair<std::string, std::string> Key;
+    std::map<Key, std::vector<size_t>> users;
+    for (bool changed = true; changed;) {
+        users.clear();
+        for (size_t i = 0; i < consumers.size(); ++i) {
+            if (!consumers[i].active)
+                continue;
+
+            auto flags = join(consumers[i].flags, " ");
+            for (const auto &source : consumers[i].sources) {
+                auto &u = users[Key(flags, source)];
+                if (u.empty() || u.back() != i)
+                    u.push_back(i);
+            }
+        }
+
+        changed = false;
+        for (auto &consumer : consumers) {
+            if (!consumer.active)
+                continue;
+
+            auto flags = join(consumer.flags, " ");
+            bool keeps = false;
+            for (const auto &source : consumer.sources)
+                keeps = keeps || users[Key(flags, source)].size() < 2;
+
+            if (!keeps) {
+                consumer.active = false;
+                changed = true;
+            }
+        }
+    }
+
+    struct Library
+    {
+        std::vector<size_t>      users;
+        std::vector<std::string> sources;
+        const Consumer           *first;
+    };
+
+    std::vector<Library> libraries;
+    for (size_t i = 0; i < consumers.size(); ++i) {
+        if (!consumers[i].active)
+            continue;
+
+        auto flags = join(consumers[i].flags, " ");
+        for (const auto &source : consumers[i].sources) {
+            const auto &u = users[Key(flags, source)];
+            if (u.size() < 2 || u.front() != i)
+                continue;
+
+            auto library = std::find_if(libraries.begin(), libraries.end(),
+                                        [&](const Library &library) {
+                return library.users == u &&
+                       library.first->flags == consumers[i].flags;
+            });
+
+            if (library == libraries.end()) {
+                libraries.push_back({ u, {}, &consumers[i] });
+                library = libraries.end() - 1;
+            }
+
+            if (std::find(library->sources.begin(), library->sources.end(),
+                          source) == library->sources.end())
+                library->sources.push_back(source);
+        }
+    }
+
+    for (size_t i = 0; i < libraries.size(); ++i) {
+        const auto &library = libraries[i];
+        auto stem = "libshared_" + std::to_string(i + 1);
+        auto name = variable(stem) + "_la";
+        stem = path(stem);
+
+        out << "noinst_LTLIBRARIES += " << stem << ".la\n\n";
+
+        sourcesGen(out, name, stem, library.sources,
+                   library.first->unityExclude);
+        out << "\n\n";
+
+        if (!library.first->flags.empty()) {
+            out << name << "_CXXFLAGS = \\\n  ";
+            join(out, library.first->flags, " \\\n  ");
+            out << "\n\n";
+        }
+
+        for (auto user : library.users) {
+            auto &sharedSources = shared->targets[consumers[user].node];
+            sharedSources.sources.insert(sharedSources.sources.end(),
+                                         library.sources.begin(),
+                                         library.sources.end());
+            sharedSources.libraries.push_back(stem + ".la");
+        }
+    }
 }
 
-class SubMakesAST : public ExtAST
+bool BlockAST::_reduceLinks = false;
+
+/*
+ * Drops the repeated dependencies, and the ones an in-tree library of the
+ * list links with, directly or not: libtool adds those after it from its
+ * .la, where a static link needs them anyway. The others keep their
+ * order. Reports on stderr how much shorter the line of variable got.
+ */
+std::vector<std::string>
+BlockAST::reduceDependencies(const std::string &variable,
+                             const std::vector<std::string> &dependencies)
 {
-    public:
-        SubMakesAST(const std::vector<std::string> &subDirs,
-                    const std::string &dir)
-            : _subDirs(subDirs), _dir(dir)
-        {
-        }
+    if (!_reduceLinks)
+        return dependencies;
+
+    std::vector<std::string> unique;
+    for (const auto &dependency : dependencies)
+        if (std::find(unique.begin(), unique.end(), dependency) == unique.end())
+            unique.push_back(dependency);
+
+    std::function<void (const std::string &,
+                        std::unordered_set<std::string> *)> visit;
+    visit = [&](const std::string &name,
+                std::unordered_set<std::string> *linked) {
+        resolveLibrary(name);
+
+        auto t = _targets.find(name);
+        if (t == _targets.end() || t->second.type != "library")
+            return;
+
+        for (const auto &dependency : t->second.dependencies)
+            if (linked->insert(dependency).second)
+                visit(dependency, linked);
+    };
+
+    std::unordered_set<std::string> implied;
+    for (const auto &dependency : unique) {
+        std::unordered_set<std::string> linked;
+        visit(dependency, &linked);
+
+        /*
+         * Libraries linking with each other would drop one another.
+         */
+        if (!linked.count(dependency))
+            implied.insert(linked.begin(), linked.end());
+    }
 
-        std::string codeGen() const;
+    std::vector<std::string> reduced;
+    for (const auto &dependency : unique)
+        if (!implied.count(dependency))
+            reduced.push_back(dependency);
+
+    if (reduced.size() < dependencies.size()) {
+        auto report = variable + ": " + std::to_string(dependencies.size())
+                      + " -> " + std::to_string(reduced.size())
+                      + " libraries\n";
+        if (_chunk)
+            _chunk->reductions << report;
+        else
+            std::cerr << report;
+    }
 
-    private:
-        std::vector<std::string> _subDirs;
-        std::string              _dir;
-};
+    return reduced;
+}
 
-class MKParser
+bool   BlockAST::_parallelTests = false;
+size_t BlockAST::_testShards = 0;
+
+/*
+ * Adds test to TESTS and to its shard, along with the runner and arguments
+ * the harness looks up for its .log, see the trailer of MKParser::codeGen().
+ * The .log waits for the node.js addons among addons, wherever they are
+ * defined, and finds them through the NODE_PATH of the test. Manual tests
+ * are only built.
+ */
+void BlockAST::testGen(Output &out, const std::string &test,
+                       const std::string &runner,
+                       const std::vector<std::string> &args, bool manual,
+                       const std::vector<std::string> &addons)
 {
-    public:
-        MKParser(const std::string &file,
-                 const std::vector<std::string> &subdirs = {});
+    if (manual)
+        return;
+
+    auto file = path(test);
+    out << "TESTS += " << file << "\n";
+    if (_testShards)
+        out << "TESTS_SHARD_" << std::to_string(hashString(file) % _testShards)
+            << " += "
+            << file << "\n";
+
+    auto stem = file;
+    auto dot = stem.find_last_of('.');
+    if (dot != std::string::npos && dot > stem.find_last_of('/') + 1)
+        stem.erase(dot);
+
+    auto log = stem + ".log";
+    for (auto &c : stem)
+        if (c == '/' || c == '-' || c == '.')
+            c = '_';
+
+    if (!runner.empty())
+        out << stem << "_LOG_RUNNER = " << runner << "\n";
+
+    if (!args.empty())
+        out << stem << "_LOG_ARGS = " << join(args, " ") << "\n";
+
+    std::vector<std::string> libraries, nodePath;
+    for (const auto &name : addons) {
+        if (_chunk)
+            useLibrary(&_chunk->usedLibraries, name);
+        else if (MKParser::_entry)
+            useLibrary(&MKParser::_entry->usedLibraries, name);
+
+        auto t = _targets.find(name);
+        if (t == _targets.end() || t->second.type != "nodejs_addon")
+            continue;
+
+        auto dir = t->second.file.substr(0,
+                                         t->second.file.find_last_of('/') + 1);
+        libraries.push_back(dir + name + ".la");
+        nodePath.push_back(absolutePath(dir + ".libs", currentDir()));
+    }
 
-        void run(std::string output = "");
-    private:
-        SubMakesAST  _subMakes;
-        BlockAST     _root;
-        mutable char _lastChar = 0;
-        std::string  _file;
+    if (!libraries.empty()) {
+        out << stem << "_NODE_PATH = " << join(nodePath, " ") << "\n";
+        out << log << ": " << join(libraries, " ") << "\n";
+    }
 
-        std::deque<Token> lexer() const;
-        Token nextToken(std::ifstream &is) const;
+    out << "\n";
+}
 
-        std::string codeGen() const;
-};
+void BlockAST::registerTarget(const Target &target)
+{
+    _targets[target.name] = target;
+    if (MKParser::_entry)
+        MKParser::_entry->targets.push_back(target);
+}
 
-MKParser::MKParser(const std::string &file,
-                   const std::vector<std::string> &subdirs)
-    : _subMakes(subdirs, file.substr(0, file.find_last_of("/")) + "/"),
-      _root(file), _file(file)
+void BlockAST::forgetTargets(const std::string &file)
 {
+    for (auto it = _targets.begin(); it != _targets.end();) {
+        if (it->second.file == file)
+            it = _targets.erase(it);
+        else
+            ++it;
+    }
 }
 
-void MKParser::run(std::string output)
+std::deque<Token> MKParser::lexer() const
 {
-    std::deque<Token> tokens = lexer();
+    std::deque<Token> tokens;
+    _lastChar = 0;
 
-    if (output.empty())
-        output = _file.substr(0, _file.find_last_of("/")) + "/Makefile.am";
+    uint64_t hash = 0;
+    if (_tokenCache) {
+        hash = contentHash();
+        if (_tokenCache->load(_file, hash, &tokens))
+            return tokens;
+    }
 
-    _root.parse(&tokens);
+    std::ifstream is(_file);
+    tokens = lexer(is);
+    is.close();
 
-    std::ofstream out(output);
-    out << codeGen();
-    out.close();
+    if (_tokenCache)
+        _tokenCache->store(_file, hash, tokens);
+
+    return tokens;
 }
 
-std::deque<Token> MKParser::lexer() const
+std::deque<Token> MKParser::lexer(std::istream &is) const
 {
     std::deque<Token> tokens;
     _lastChar = 0;
 
-    std::ifstream is(_file);
     while (is.good()) {
         auto token = nextToken(is);
         tokens.push_back(token);
     }
 
-    is.close();
-
     return tokens;
 }
 
-Token MKParser::nextToken(std::ifstream &is) const
+/*
+ * Cuts a .mk file into its top level statements: lines joined by a trailing
+ * '\\' or by unbalanced parentheses, and whole ifeq ... endif blocks.
+ */
+std::vector<std::string> MKParser::split(const std::string &text)
+{
+    std::vector<std::string> statements;
+    std::string statement;
+    int depth = 0;
+    int blocks = 0;
+
+    std::istringstream is(text);
+    std::string line;
+    while (std::getline(is, line)) {
+        statement += line + "\n";
+
+        auto code = line.substr(0, line.find('#'));
+        for (auto c : code)
+            depth += (c == '(') - (c == ')');
+
+        auto start = code.find_first_not_of(" \t");
+        if (start != std::string::npos) {
+            if (code.compare(start, 4, "ifeq") == 0)
+                ++blocks;
+            else if (code.compare(start, 5, "endif") == 0)
+                --blocks;
+        }
+
+        auto end = code.find_last_not_of(" \t\r");
+        if ((end != std::string::npos && code[end] == '\\') || depth > 0 ||
+            blocks > 0)
+            continue;
+
+        if (statement.find_first_not_of(" \t\r\n") != std::string::npos)
+            statements.push_back(statement);
+
+        statement.clear();
+        depth = blocks = 0;
+    }
+
+    if (statement.find_first_not_of(" \t\r\n") != std::string::npos)
+        statements.push_back(statement);
+
+    return statements;
+}
+
+/*
+ * Parses the file again reusing what is still valid from its last parse.
+ * A $(eval ...) statement whose text didn't change and whose attributes
+ * still expand to the same values keeps its nodes, only the libraries and
+ * targets it defines are registered again. Everything else, assignments
+ * and ifeq blocks included, goes through the parser, so attributes are
+ * always re-evaluated and their changes reach the statements using them.
+ */
+void MKParser::parseIncremental()
+{
+    auto &statements = (*_statements)[_file];
+
+    std::unordered_multimap<uint64_t, size_t> previous;
+    for (size_t i = 0; i < statements.size(); ++i)
+        previous.emplace(statements[i].hash, i);
+
+    std::vector<Statement> current;
+    for (const auto &text : split(readFile(_file))) {
+        auto hash = hashString(text);
+
+        auto it = previous.find(hash);
+        if (it != previous.end()) {
+            auto &statement = statements[it->second];
+            previous.erase(it);
+
+            bool valid = statement.reusable;
+            for (const auto &read : statement.reads)
+                valid = valid && _root.attributeHash(read.first) == read.second;
+
+            if (valid) {
+                for (const auto &library : statement.libraries) {
+                    BlockAST::_libraryMap[library.first].first =
+                        library.second;
+                    _entry->libraries.push_back(library);
+                }
+
+                for (const auto &target : statement.targets)
+                    BlockAST::registerTarget(target);
+
+                _root.append(statement.nodes);
+                current.push_back(std::move(statement));
+                continue;
+            }
+        }
+
+        Statement statement;
+        statement.hash = hash;
+        statement.reusable = text.find_first_not_of(" \t\r\n") ==
+                             text.find('$');
+
+        auto libraries = _entry->libraries.size();
+        auto targets = _entry->targets.size();
+
+        std::istringstream is(text);
+        auto tokens = lexer(is);
+        statement.nodes = _root.parseStatement(&tokens, &statement.reads);
+
+        statement.libraries.assign(_entry->libraries.begin() + libraries,
+                                   _entry->libraries.end());
+        statement.targets.assign(_entry->targets.begin() + targets,
+                                 _entry->targets.end());
+
+        current.push_back(std::move(statement));
+    }
+
+    statements = std::move(current);
+}
+
+Token MKParser::nextToken(std::istream &is) const
 {
     auto c = _lastChar ? _lastChar : is.get();
 
@@ -555,57 +4230,536 @@ Token MKParser::nextToken(std::ifstream &is) const
     throw Exception(err);
 }
 
-std::string MKParser::codeGen() const
+/*
+ * The configure variables _libraryMap refers to, which automake would
+ * define in every Makefile.in.
+ */
+std::vector<std::string> MKParser::substitutions()
 {
-    std::string code;
-    code +=  "ACLOCAL_AMFLAGS = -I m4\n\n";
-    code +=  "AM_CPPFLAGS = \\\n";
-    code +=  "  -I $(abs_top_builddir)\n\n";
-
-    code +=  "lib_LTLIBRARIES =\n";
-    code +=  "noinst_LTLIBRARIES =\n\n";
-
-    code += "NODEJS_LIBTOOL_FLAGS = \\\n";
-    code += "-shrext .node \\\n";
-    code += "-module \\\n";
-    code += "-shared \\\n";
-    code += "-avoid-version \\\n";
-    code += "-rpath $(abs_builddir) \\\n";
-    code += "-fPIC \\\n";
-    code += "-Wall \\\n";
-    code += "-m64 \\\n";
-    code += "-fdata-sections \\\n";
-    code += "-ffunction-sections \\\n";
-    code += "-fno-strict-aliasing \\\n";
-    code += "-fno-rtti \\\n";
-    code += "-fno-exceptions\n\n";
-    code += "TESTS =\n";
-    code += "check_PROGRAMS =\n";
-    code += "bin_PROGRAMS =\n";
-    code += "SUBDIRS =\n\n";
-
-    code += _subMakes.codeGen();
-    code += _root.codeGen();
-
-    code += "\nTESTS_ENVIRONMENT = $(abs_top_builddir)/test_driver.sh "
+    std::vector<std::string> variables;
+    for (const auto &library : BlockAST::_builtinLibraryMap) {
+        for (const auto &value : { library.second.first,
+                                   library.second.second }) {
+            for (size_t i = value.find("$("); i != std::string::npos;
+                 i = value.find("$(", i + 2)) {
+                auto end = value.find(')', i);
+                if (end != std::string::npos)
+                    variables.push_back(value.substr(i + 2, end - i - 2));
+            }
+        }
+    }
+
+    std::sort(variables.begin(), variables.end());
+    variables.erase(std::unique(variables.begin(), variables.end()),
+                    variables.end());
+    return variables;
+}
+
+void MKParser::codeGen(Output &out) const
+{
+    static const char preamble[] =
+        "ACLOCAL_AMFLAGS = -I m4\n\n"
+        "AM_CPPFLAGS = \\\n"
+        "  -I $(abs_top_builddir)\n\n"
+        "lib_LTLIBRARIES =\n"
+        "noinst_LTLIBRARIES =\n"
+        "NODEJS_NODE_FILES =\n\n"
+        "NODEJS_LIBTOOL_FLAGS = \\\n"
+        "-shrext .node \\\n"
+        "-module \\\n"
+        "-shared \\\n"
+        "-avoid-version \\\n"
+        "-rpath $(abs_builddir) \\\n"
+        "-fPIC \\\n"
+        "-Wall \\\n"
+        "-m64 \\\n"
+        "-fdata-sections \\\n"
+        "-ffunction-sections \\\n"
+        "-fno-strict-aliasing \\\n"
+        "-fno-rtti \\\n"
+        "-fno-exceptions\n\n"
+        "TESTS =\n"
+        "check_PROGRAMS =\n"
+        "bin_PROGRAMS =\n";
+
+    /*
+     * The hooks copy the .node files of the addons, NODEJS_NODE_FILES, to
+     * node_prefix with a single cp, and take them out with a single rm.
+     */
+    static const char trailer[] =
+        "\nTESTS_ENVIRONMENT = $(abs_top_builddir)/test_driver.sh "
         "NODE=$(NODEJS) VOWS=$(VOWS) NODE_LIBS=\""
-        "$(noinst_LTLIBRARIES)\"\n";
+        "$(noinst_LTLIBRARIES)\"\n"
+        "TESTS += $(abs_top_builddir)/runjstest.sh\n\n"
+        "node_prefix=$(exec_prefix)/node_modules\n\n"
+        "install-exec-hook:\n"
+        "\tmkdir -p $(node_prefix)\n"
+        "\ttest -z \"$(NODEJS_NODE_FILES)\" || "
+        "cp -f $(NODEJS_NODE_FILES) $(node_prefix)\n"
+        "uninstall-hook:\n"
+        "\t@set x; for i in $(NODEJS_NODE_FILES); do "
+        "set \"$$@\" \"$(node_prefix)/$${i##*/}\"; done; shift; \\\n"
+        "\ttest $$# -eq 0 || rm -f \"$$@\"\n"
+        "\tif find \"$(node_prefix)\" -maxdepth 0 -empty | read; "
+        "then rm -rf $(node_prefix); fi\n";
 
-    code += "TESTS += $(abs_top_builddir)/runjstest.sh\n\n";
+    /*
+     * With --parallel-tests, automake's parallel harness runs each test on
+     * its own, logging to its own .log, in place of runjstest.sh. The runner
+     * and arguments of a test, and the directories of the addons it adds to
+     * NODE_PATH, are looked up from the name of the .log being made, see
+     * BlockAST::testGen(), which takes GNU make, hence the silenced
+     * automake's portability warnings. check-shard runs TESTS_SHARD_$(SHARD)
+     * only, so that CI machines can split the tests between them.
+     */
+    static const char testsEnvironment[] =
+        "\nTESTS_ENVIRONMENT = $(abs_top_builddir)/test_driver.sh "
+        "NODE=$(NODEJS) VOWS=$(VOWS) NODE_LIBS=\""
+        "$(noinst_LTLIBRARIES)\"\n"
+        "TESTS += $(abs_top_builddir)/runjstest.sh\n\n";
+
+    static const char harness[] =
+        " -Wno-portability\n"
+        "TEST_EXTENSIONS = .js .coffee .py\n"
+        "mk_test = $(subst /,_,$(subst -,_,$(subst .,_,$(@:.log=))))\n"
+        "LOG_COMPILER = $($(mk_test)_LOG_RUNNER)\n"
+        "AM_LOG_FLAGS = $($(mk_test)_LOG_ARGS)\n"
+        "JS_LOG_COMPILER = $($(mk_test)_LOG_RUNNER)\n"
+        "AM_JS_LOG_FLAGS = $($(mk_test)_LOG_ARGS)\n"
+        "COFFEE_LOG_COMPILER = $($(mk_test)_LOG_RUNNER)\n"
+        "AM_COFFEE_LOG_FLAGS = $($(mk_test)_LOG_ARGS)\n"
+        "PY_LOG_COMPILER = $($(mk_test)_LOG_RUNNER)\n"
+        "AM_PY_LOG_FLAGS = $($(mk_test)_LOG_ARGS)\n\n"
+        "mk_empty =\n"
+        "mk_space = $(mk_empty) $(mk_empty)\n"
+        "mk_node_path = $(subst $(mk_space),:,$(sort $(addprefix "
+        "$(abs_builddir)/,$(addsuffix .libs,$(dir $(noinst_LTLIBRARIES)))) "
+        "$($(mk_test)_NODE_PATH)))\n"
+        "AM_TESTS_ENVIRONMENT = NODE_PATH=$(mk_node_path); "
+        "NODE_LIBS='$(noinst_LTLIBRARIES)'; export NODE_PATH NODE_LIBS;\n\n"
+        "VALGRIND = valgrind\n"
+        "VALGRIND_FLAGS = --error-exitcode=1 --leak-check=full --quiet\n\n";
+
+    static const char shards[] =
+        "SHARD = 0\n\n"
+        "check-shard: all\n"
+        "\t@$(MAKE) $(AM_MAKEFLAGS) check-shard-tests\n\n"
+        "check-shard-tests:\n";
+
+    static const char shardsRecursion[] =
+        "\t@list='$(SUBDIRS)'; for subdir in $$list; do \\\n"
+        "\t  test \"$$subdir\" = . || (cd $$subdir && "
+        "$(MAKE) $(AM_MAKEFLAGS) check-shard-tests) || exit 1; \\\n"
+        "\tdone\n";
+
+    static const char shardsTests[] =
+        "\t@$(MAKE) $(AM_MAKEFLAGS) check-TESTS "
+        "TESTS='$(TESTS_SHARD_$(SHARD))'\n\n"
+        ".PHONY: check-shard check-shard-tests\n\n";
+
+    auto tests = [](const char *text) {
+        if (!BlockAST::_parallelTests)
+            return std::string(text);
+
+        std::string environment = _backend == Backend::NON_RECURSIVE
+                                  ? "\nAUTOMAKE_OPTIONS +=" : "\nAUTOMAKE_OPTIONS =";
+        environment += harness;
+        if (BlockAST::_testShards) {
+            environment += shards;
+            if (_backend != Backend::NON_RECURSIVE)
+                environment += shardsRecursion;
+
+            environment += shardsTests;
+        }
 
-    code += "node_prefix=$(exec_prefix)/node_modules\n\n";
-    code += "install-exec-hook:\n";
-    code += "\tmkdir -p $(node_prefix)\n";
-    code += "\tcp -rf .libs/*.node $(node_prefix)\n";
-    code += "uninstall-hook:\n";
+        return replaceAll(text, testsEnvironment, environment);
+    };
+
+    auto shardsGen = [](Output &out) {
+        for (size_t i = 0; i < BlockAST::_testShards; ++i)
+            out << "TESTS_SHARD_" << std::to_string(i) << " =\n";
+
+        if (BlockAST::_testShards)
+            out << "\n";
+    };
+
+    /*
+     * With convenience libraries next to them, the addons get a list of
+     * their own.
+     */
+    auto addons = [](const std::string &text) {
+        if (!BlockAST::_addonList)
+            return text;
+
+        return replaceAll(text, "$(noinst_LTLIBRARIES)", "$(NODEJS_ADDONS)");
+    };
+
+    /*
+     * config.ninja, written by configure, sets cxx, cxxflags, ldflags and
+     * the variables _libraryMap refers to.
+     */
+    static const char ninjaPreamble[] =
+        "ninja_required_version = 1.3\n\n"
+        "builddir = build\n"
+        "include config.ninja\n\n"
+        "rule cxx\n"
+        "  command = $cxx -MMD -MF $out.d -I . -I $builddir $cxxflags $flags "
+        "-c $in -o $out\n"
+        "  depfile = $out.d\n"
+        "  deps = gcc\n"
+        "  description = CXX $out\n\n"
+        "rule link\n"
+        "  command = $cxx $ldflags -o $out $in $libs -Wl,-rpath,'$rpath'\n"
+        "  description = LINK $out\n\n"
+        "rule shlib\n"
+        "  command = $cxx -shared $ldflags -o $out $in $libs "
+        "-Wl,-rpath,'$rpath'\n"
+        "  description = SHLIB $out\n\n"
+        "rule test\n"
+        "  command = $in && touch $out\n"
+        "  description = TEST $in\n\n"
+        "rule unity\n"
+        "  command = printf '#include \"%s\"\\n' $sources > $out\n"
+        "  description = UNITY $out\n\n";
+
+    /*
+     * The configure substitutions, and then the automake rules we rely on:
+     * libtool compiles and links with per target flags, tests, install,
+     * clean and the recursion into SUBDIRS, written with GNU make
+     * functions over the variables of the Makefile.am. An object is named
+     * after its target and its source, directory included, as with
+     * subdir-objects, so a/x.cc and b/x.cc of one target don't collide.
+     */
+    static const char makefileInHeader[] =
+        "SHELL = @SHELL@\n"
+        "srcdir = @srcdir@\n"
+        "top_srcdir = @top_srcdir@\n"
+        "VPATH = @srcdir@\n"
+        "top_builddir = @top_builddir@\n"
+        "abs_builddir = @abs_builddir@\n"
+        "abs_srcdir = @abs_srcdir@\n"
+        "abs_top_builddir = @abs_top_builddir@\n"
+        "prefix = @prefix@\n"
+        "exec_prefix = @exec_prefix@\n"
+        "bindir = @bindir@\n"
+        "libdir = @libdir@\n"
+        "DEFS = @DEFS@\n"
+        "CXX = @CXX@\n"
+        "CPPFLAGS = @CPPFLAGS@\n"
+        "CXXFLAGS = @CXXFLAGS@\n"
+        "LDFLAGS = @LDFLAGS@\n"
+        "LIBS = @LIBS@\n"
+        "LIBTOOL = @LIBTOOL@\n"
+        "INSTALL = @INSTALL@\n"
+        "INSTALL_PROGRAM = @INSTALL_PROGRAM@\n"
+        "DEPDIR = .deps\n"
+        "NODEJS = @NODEJS@\n"
+        "VOWS = @VOWS@\n";
+
+    static const char makefileInRules[] =
+        "\n"
+        ".DEFAULT_GOAL := all\n"
+        "\n"
+        "LTCXXCOMPILE = $(LIBTOOL) --tag=CXX --mode=compile $(CXX) $(DEFS) "
+        "-I. $(AM_CPPFLAGS) $(CPPFLAGS)\n"
+        "CXXLINK = $(LIBTOOL) --tag=CXX --mode=link $(CXX) $(CXXFLAGS) "
+        "$(LDFLAGS)\n"
+        "\n"
+        "am_canon = $(subst -,_,$(subst .,_,$(subst /,_,$(1))))\n"
+        "am_sources = $($(call am_canon,$(1))_SOURCES) $(nodist_$(call "
+        "am_canon,$(1))_SOURCES)\n"
+        "am_object = $(call am_canon,$(1))-$(call am_canon,$(basename "
+        "$(2))).lo\n"
+        "am_objects = $(foreach s,$(call am_sources,$(1)),$(call "
+        "am_object,$(1),$(s)))\n"
+        "\n"
+        "define am_compile\n"
+        "$(1): $(2) $$($(3)_PCH)\n"
+        "\t@mkdir -p $(DEPDIR)\n"
+        "\t$$(LTCXXCOMPILE) $$($(3)_CXXFLAGS) $$(CXXFLAGS) $$($(3)_OPTIONS) "
+        "-MT $$@ -MD -MP "
+        "-MF $(DEPDIR)/$(1:.lo=.Plo) -c -o $$@ $$<\n"
+        "endef\n"
+        "\n"
+        "define am_link\n"
+        "$(1): $(call am_objects,$(1)) $$(filter %.la,$$($(2)))\n"
+        "\t$$(CXXLINK) $$($(call am_canon,$(1))_LDFLAGS) $(3) -o $$@ "
+        "$(call am_objects,$(1)) $$($(2)) $$(LIBS)\n"
+        "endef\n"
+        "\n"
+        "$(foreach t,$(bin_PROGRAMS) $(check_PROGRAMS) $(lib_LTLIBRARIES) "
+        "$(noinst_LTLIBRARIES),$(foreach s,$(call am_sources,$(t)),"
+        "$(eval $(call am_compile,$(call am_object,$(t),$(s)),$(s),$(call "
+        "am_canon,$(t))))))\n"
+        "$(foreach p,$(bin_PROGRAMS) $(check_PROGRAMS),$(eval $(call "
+        "am_link,$(p),$(call am_canon,$(p))_LDADD,)))\n"
+        "$(foreach l,$(lib_LTLIBRARIES),$(eval $(call am_link,$(l),$(call "
+        "am_canon,$(l))_LIBADD,-rpath $(libdir))))\n"
+        "$(foreach l,$(noinst_LTLIBRARIES),$(eval $(call "
+        "am_link,$(l),$(call am_canon,$(l))_LIBADD,)))\n"
+        "\n"
+        "am_recursive = all check install uninstall clean distclean\n"
+        "\n";
+
+    static const char makefileInRecursion[] =
+        "$(am_recursive):\n"
+        "\t@for dir in $(SUBDIRS); do $(MAKE) -C $$dir $@ || exit 1; done\n"
+        "\t@$(MAKE) $@-am\n";
+
+    /*
+     * Each directory of SUBDIRS, . included, waits only for the ones in its
+     * SUBDIRS_DEPS_DIR, so make -j recurses into the others concurrently.
+     */
+    static const char makefileInParallelRecursion[] =
+        "am_subdir = $(if $(filter .,$(1)),$(2)-am,$(2)-subdir-$(1))\n"
+        "\n"
+        "define am_recurse\n"
+        "$(2)-subdir-$(1): $(foreach d,$(SUBDIRS_DEPS_$(call "
+        "am_canon,$(1))),$(call am_subdir,$(d),$(2)))\n"
+        "\t@$(MAKE) -C $(1) $(2)\n"
+        "endef\n"
+        "\n"
+        "$(foreach t,$(am_recursive),$(foreach d,$(filter-out "
+        ".,$(SUBDIRS)),$(eval $(call am_recurse,$(d),$(t)))))\n"
+        "$(foreach t,$(am_recursive),$(eval $(t)-am: $(foreach "
+        "d,$(SUBDIRS_DEPS__),$(call am_subdir,$(d),$(t)))))\n"
+        "$(foreach t,$(am_recursive),$(eval $(t): $(foreach "
+        "d,$(SUBDIRS),$(call am_subdir,$(d),$(t)))))\n"
+        "\n"
+        ".PHONY: $(foreach t,$(am_recursive),$(foreach d,$(filter-out "
+        ".,$(SUBDIRS)),$(t)-subdir-$(d)))\n";
+
+    static const char makefileInTargets[] =
+        "\n"
+        "all-am: $(bin_PROGRAMS) $(lib_LTLIBRARIES) $(noinst_LTLIBRARIES)\n"
+        "\n"
+        "check-am: all-am $(check_PROGRAMS)\n"
+        "\t@failed=0; for t in $(TESTS); do \\\n"
+        "\t  if test -f ./$$t; then p=./$$t; else p=$$t; fi; \\\n"
+        "\t  if $(TESTS_ENVIRONMENT) $$p; then echo \"PASS: $$t\"; \\\n"
+        "\t  else echo \"FAIL: $$t\"; failed=`expr $$failed + 1`; fi; \\\n"
+        "\tdone; test $$failed -eq 0\n"
+        "\n"
+        "install-am: all-am\n"
+        "\t@for p in $(lib_LTLIBRARIES); do \\\n"
+        "\t  mkdir -p $(DESTDIR)$(libdir) && \\\n"
+        "\t  $(LIBTOOL) --mode=install $(INSTALL) $$p "
+        "$(DESTDIR)$(libdir)/$${p##*/} || exit 1; \\\n"
+        "\tdone\n"
+        "\t@for p in $(bin_PROGRAMS); do \\\n"
+        "\t  mkdir -p $(DESTDIR)$(bindir) && \\\n"
+        "\t  $(LIBTOOL) --mode=install $(INSTALL_PROGRAM) $$p "
+        "$(DESTDIR)$(bindir)/$${p##*/} || exit 1; \\\n"
+        "\tdone\n"
+        "\t@$(MAKE) install-exec-hook\n"
+        "\n"
+        "uninstall-am:\n"
+        "\t@for p in $(lib_LTLIBRARIES); do \\\n"
+        "\t  $(LIBTOOL) --mode=uninstall rm -f "
+        "$(DESTDIR)$(libdir)/$${p##*/}; \\\n"
+        "\tdone\n"
+        "\t@for p in $(bin_PROGRAMS); do \\\n"
+        "\t  $(LIBTOOL) --mode=uninstall rm -f "
+        "$(DESTDIR)$(bindir)/$${p##*/}; \\\n"
+        "\tdone\n"
+        "\t@$(MAKE) uninstall-hook\n"
+        "\n"
+        "clean-am:\n"
+        "\t-$(LIBTOOL) --mode=clean rm -f $(bin_PROGRAMS) "
+        "$(check_PROGRAMS) $(lib_LTLIBRARIES) $(noinst_LTLIBRARIES) *.lo "
+        "$(CLEANFILES)\n"
+        "\t-rm -rf .libs _libs $(DEPDIR)\n"
+        "\n"
+        "-include $(wildcard $(DEPDIR)/*.Plo)\n"
+        "\n"
+        ".PHONY: $(am_recursive) $(am_recursive:=-am) install-exec-hook "
+        "uninstall-hook\n";
+
+    static const char makefileInConfigure[] =
+        "\n"
+        "distclean-am: clean-am\n"
+        "\t-rm -f Makefile\n"
+        "\n"
+        "Makefile: $(srcdir)/Makefile.in $(top_builddir)/config.status\n"
+        "\tcd $(top_builddir) && $(SHELL) ./config.status "
+        "$(subdir)/Makefile\n";
+
+    /*
+     * Loaded into make, what configure substitutes defaults to the make
+     * running, and the Makefile is the user's own.
+     */
+    static const char moduleHeader[] =
+        "srcdir ?= .\n"
+        "top_builddir ?= .\n"
+        "abs_builddir ?= $(CURDIR)\n"
+        "abs_top_builddir ?= $(CURDIR)\n"
+        "prefix ?= /usr/local\n"
+        "exec_prefix ?= $(prefix)\n"
+        "bindir ?= $(exec_prefix)/bin\n"
+        "libdir ?= $(exec_prefix)/lib\n"
+        "LIBTOOL ?= libtool\n"
+        "INSTALL ?= install\n"
+        "INSTALL_PROGRAM ?= $(INSTALL)\n"
+        "DEPDIR = .deps\n"
+        "NODEJS ?= node\n"
+        "VOWS ?= vows\n\n";
+
+    static const char moduleTargets[] =
+        "\n"
+        "distclean-am: clean-am\n";
+
+    /*
+     * The options of a source, added to the _OPTIONS of the targets
+     * compiling it for its object only.
+     */
+    static const char *const moduleOptions[] = {
+        "$(foreach t,$(bin_PROGRAMS) $(check_PROGRAMS) $(lib_LTLIBRARIES) "
+        "$(noinst_LTLIBRARIES),$(foreach s,$(filter ",
+        ",$(call am_sources,$(t))),$(eval $(call am_object,$(t),$(s)): "
+        "$(call am_canon,$(t))_OPTIONS += ",
+        ")))\n"
+    };
+
+    if (_module) {
+        if (!_file.empty()) {
+            _root.codeGen(out);
+            return;
+        }
 
-    code += "\tfor i in $(noinst_LTLIBRARIES); do lib=`echo \"$$i\" | "
-        "sed 's/\\.la/\\.node/g'`; rm $(node_prefix)/$$lib; done\n";
+        /*
+         * With no .mk, what follows every function make expanded: the
+         * preamble less the lists they appended to, and the rules.
+         */
+        out << moduleHeader;
+
+        std::istringstream lines(preamble);
+        std::string line;
+        while (std::getline(lines, line)) {
+            if (line.size() < 2 || line.compare(line.size() - 2, 2, " =") != 0)
+                out << line << "\n";
+        }
 
-    code += "\tif find \"$(node_prefix)\" -maxdepth 0 -empty | read; "
-        "then rm -rf $(node_prefix); fi\n";
+        out << addons(trailer) << makefileInRules << makefileInRecursion
+            << makefileInTargets << moduleTargets;
+
+        for (const auto &option : _moduleOptions)
+            out << moduleOptions[0] << option.first << moduleOptions[1]
+                << join(option.second, " ") << moduleOptions[2];
+
+        return;
+    }
+
+    if (_backend == Backend::MAKEFILE_IN) {
+        out << "# Generated by mk_parser " MK_PARSER_VERSION " from the .mk "
+               "next to it, do not edit.\n\n" << makefileInHeader;
+
+        out << "subdir = "
+            << (_dir.empty() ? "." : _dir.substr(0, _dir.size() - 1)) << "\n";
+
+        for (const auto &variable : substitutions())
+            out << variable << " = @" << variable << "@\n";
+
+        out << "\n" << preamble << "SUBDIRS =\n\n";
+        if (BlockAST::_unitySize || BlockAST::_pch)
+            out << "CLEANFILES =\n\n";
+
+        if (BlockAST::_addonList)
+            out << "NODEJS_ADDONS =\n\n";
+
+        std::vector<Subtree> ordered;
+        auto parent = _subdirs;
+        _subdirs = _orderSubdirs ? &ordered : nullptr;
+
+        _subMakes.codeGen(out);
+        _root.shareSources(out, &_shared);
+        _root.codeGen(out);
+
+        _subdirs = parent;
+        if (_orderSubdirs)
+            subdirsGen(out, ordered);
+
+        out << addons(trailer) << makefileInRules
+            << (_orderSubdirs ? makefileInParallelRecursion
+                              : makefileInRecursion)
+            << makefileInTargets << makefileInConfigure;
+    }
+    else if (_backend == Backend::NINJA) {
+        BlockAST::Goals goals;
+        auto parent = BlockAST::_goals;
+        BlockAST::_goals = &goals;
+
+        if (_dir.empty())
+            out << ninjaPreamble;
+
+        try {
+            _subMakes.codeGen(out);
+            _root.shareSources(out, &_shared);
+            _root.codeGen(out);
+        } catch (...) {
+            BlockAST::_goals = parent;
+            throw;
+        }
+
+        BlockAST::_goals = parent;
+
+        out << "build " << _dir << "all: phony";
+        for (const auto &goal : goals.all)
+            out << " " << goal;
+
+        out << "\nbuild " << _dir << "check: phony";
+        for (const auto &goal : goals.check)
+            out << " " << goal;
+
+        out << "\n";
+
+        if (_dir.empty())
+            out << "\ndefault all\n";
+    }
+    else if (_backend == Backend::AUTOMAKE) {
+        out << preamble << "SUBDIRS =\n\n";
+        if (BlockAST::_unitySize || BlockAST::_pch)
+            out << "CLEANFILES =\n\n";
+
+        if (BlockAST::_addonList)
+            out << "NODEJS_ADDONS =\n\n";
+
+        shardsGen(out);
+
+        std::vector<Subtree> ordered;
+        auto parent = _subdirs;
+        _subdirs = _orderSubdirs ? &ordered : nullptr;
+
+        _subMakes.codeGen(out);
+        _root.shareSources(out, &_shared);
+        _root.codeGen(out);
 
-    return code;
+        _subdirs = parent;
+        if (_orderSubdirs)
+            subdirsGen(out, ordered);
+
+        out << addons(tests(trailer));
+    }
+    else if (_dir.empty()) {
+        out << "AUTOMAKE_OPTIONS = subdir-objects\n\n" << preamble << "\n";
+        if (BlockAST::_unitySize || BlockAST::_pch)
+            out << "CLEANFILES =\n\n";
+
+        if (BlockAST::_addonList)
+            out << "NODEJS_ADDONS =\n\n";
+
+        shardsGen(out);
+
+        _subMakes.codeGen(out);
+        _root.shareSources(out, &_shared);
+        _root.codeGen(out);
+
+        out << addons(tests(trailer));
+    }
+    else {
+        _subMakes.codeGen(out);
+        _root.shareSources(out, &_shared);
+        _root.codeGen(out);
+    }
 }
 
 class ProgramAST : public ExtAST
@@ -614,9 +4768,11 @@ class ProgramAST : public ExtAST
         ProgramAST(const std::string &name,
                   const std::vector<std::string> &dependencies,
                   const std::vector<std::string> &sources,
-                  const std::vector<std::string> &targets)
+                  const std::vector<std::string> &targets,
+                  const std::vector<std::string> &unityExclude,
+                  const std::string &pch)
             : _name(name), _dependencies(dependencies), _sources(sources),
-              _targets(targets)
+              _targets(targets), _unityExclude(unityExclude), _pch(pch)
         {
         }
 
@@ -625,46 +4781,128 @@ class ProgramAST : public ExtAST
         std::vector<std::string> _dependencies;
         std::vector<std::string> _sources;
         std::vector<std::string> _targets;
-
-        std::string codeGen() const;
+        std::vector<std::string> _unityExclude;
+        std::string              _pch;
+
+        void codeGen(Output &out) const;
+        void ninjaGen(Output &out) const;
+        bool compiles(std::vector<std::string> *sources,
+                      std::vector<std::string> *dependencies,
+                      std::vector<std::string> *unityExclude) const;
+        std::string target() const;
 };
 
-std::string ProgramAST::codeGen() const
+std::string ProgramAST::target() const
 {
-    std::string code;
-
-    code = "bin_PROGRAMS += " + _name + "\n\n";
+    return _name;
+}
 
-    code += _name + "_SOURCES = \\\n  ";
-    if (_sources.empty())
-        code += _name + ".cc";
-    else
-        code += join(_sources, " \\\n  ");
+void ProgramAST::codeGen(Output &out) const
+{
+    if (MKParser::_backend == MKParser::Backend::NINJA) {
+        ninjaGen(out);
+        return;
+    }
 
-    if (!_dependencies.empty()) {
-        code += "\n\n" + _name + "_LDADD = \\\n  ";
-
-        std::vector<std::string> cxxFlags;
-        auto copyDependencies = _dependencies;
-        for (auto &dependency : copyDependencies) {
-            auto t = BlockAST::_libraryMap.find(dependency);
-            if (t != BlockAST::_libraryMap.end()) {
-                dependency = t->second.first;
-                if (!t->second.second.empty())
-                    cxxFlags.push_back(t->second.second);
-            }
+    auto name = BlockAST::variable(_name);
+
+    out << "bin_PROGRAMS += " << BlockAST::path(_name) << "\n\n";
+
+    auto sources = _sources.empty()
+                   ? std::vector<std::string>{ _name + ".cc" } : _sources;
+    auto shared = BlockAST::sharedSources(this);
+    if (shared)
+        sources.erase(std::remove_if(sources.begin(), sources.end(),
+                                     [&](const std::string &source) {
+            return std::find(shared->sources.begin(), shared->sources.end(),
+                             source) != shared->sources.end();
+        }), sources.end());
+
+    std::vector<std::string> options;
+    auto groups = BlockAST::optionGroups(&sources, &options);
+
+    BlockAST::sourcesGen(out, name, BlockAST::path(_name), sources,
+                         _unityExclude);
+
+    std::vector<std::string> libraries;
+    for (size_t i = 0; i < groups.size(); ++i)
+        libraries.push_back(BlockAST::path("lib" + _name + "_opt"
+                                           + std::to_string(i + 1) + ".la"));
+
+    if (shared)
+        libraries.insert(libraries.end(), shared->libraries.begin(),
+                         shared->libraries.end());
+
+    std::vector<std::string> cxxFlags;
+    auto dependencies = BlockAST::reduceDependencies(name + "_LDADD",
+                                                     _dependencies);
+    auto linked = !dependencies.empty() || !libraries.empty();
+    if (linked) {
+        out << "\n\n" << name << "_LDADD = \\\n  ";
+
+        if (!libraries.empty()) {
+            join(out, libraries, " \\\n  ");
+            if (!dependencies.empty())
+                out << " \\\n  ";
         }
-        code += join(copyDependencies, " \\\n  ");
-        code += "\n\n";
 
-        if (!cxxFlags.empty()) {
-            code += _name + "_CXXFLAGS = \\\n  ";
-            code += join(cxxFlags, " \\\n  ");
-            code += "\n\n";
-        }
+        BlockAST::dependenciesGen(out, dependencies, &cxxFlags);
+        out << "\n\n";
+    }
+
+    if (dependencies.size() < _dependencies.size()) {
+        Buffer ignored;
+        cxxFlags.clear();
+        BlockAST::dependenciesGen(ignored, _dependencies, &cxxFlags);
+    }
+
+    auto flags = cxxFlags;
+
+    Buffer rest;
+    BlockAST::pchGen(rest, name, BlockAST::path(_name), sources, _pch,
+                     cxxFlags, &cxxFlags);
+
+    BlockAST::ownOptionsGen(rest, name, options, &cxxFlags);
+
+    if (!cxxFlags.empty()) {
+        rest << name << "_CXXFLAGS = \\\n  ";
+        join(rest, cxxFlags, " \\\n  ");
+        rest << "\n\n";
     }
 
-    return code;
+    BlockAST::optionsGen(rest, _name, groups, flags);
+
+    if (rest.size())
+        out << (linked ? "" : "\n\n") << rest.str();
+}
+
+void ProgramAST::ninjaGen(Output &out) const
+{
+    std::vector<std::string> inputs, libs, cxxFlags;
+    BlockAST::ninjaDependencies(_dependencies, &inputs, &libs, &cxxFlags);
+
+    auto objects = BlockAST::ninjaObjectsGen(out, _name, _sources.empty()
+                       ? std::vector<std::string>{ _name + ".cc" } : _sources,
+                       cxxFlags, &_unityExclude);
+
+    auto program = "$builddir/bin/" + BlockAST::path(_name);
+    BlockAST::ninjaLinkGen(out, "link", program, objects, inputs, libs,
+                           BlockAST::ninjaRpath("bin/"));
+    BlockAST::buildGoal(program);
+}
+
+bool ProgramAST::compiles(std::vector<std::string> *sources,
+                          std::vector<std::string> *dependencies,
+                          std::vector<std::string> *unityExclude) const
+{
+    if (BlockAST::_pch && (!_pch.empty() || BlockAST::_inferPch))
+        return false;
+
+    *sources = _sources.empty() ? std::vector<std::string>{ _name + ".cc" }
+                                : _sources;
+    *dependencies = _dependencies;
+    *unityExclude = _unityExclude;
+    return true;
 }
 
 /*
@@ -684,8 +4922,18 @@ BlockAST::parseProgram(const Attributes &attributes, const std::string &file,
     if (args.at(0).size() != 1)
         throw Exception("Must have only 1 name");
 
+    registerTarget({ args.at(0).at(0), "program", file,
+                     args.at(2).empty() ? std::vector<std::string>{
+                         args.at(0).at(0) + ".cc" } : args.at(2),
+                     args.at(1) });
+
     return std::make_shared<ProgramAST>(args.at(0).at(0), args.at(1),
-                                        args.at(2), args.at(3));
+                                        args.at(2), args.at(3),
+                                        attribute(attributes,
+                                                  "UNITY_EXCLUDE"),
+                                        join(attribute(attributes,
+                                                       args.at(0).at(0)
+                                                       + "_PCH"), " "));
 }
 
 class LibraryAST : public ExtAST
@@ -695,9 +4943,12 @@ class LibraryAST : public ExtAST
                    const std::vector<std::string> &sources,
                    const std::vector<std::string> &dependencies,
                    const std::string & output, const std::string &extension,
-                   const std::string &buildName)
+                   const std::string &buildName,
+                   const std::vector<std::string> &unityExclude,
+                   const std::string &pch)
             : _name(name), _sources(sources), _dependencies(dependencies),
-              _extension(extension), _output(output), _buildName(buildName)
+              _extension(extension), _output(output), _buildName(buildName),
+              _unityExclude(unityExclude), _pch(pch)
         {
         }
 
@@ -708,48 +4959,137 @@ class LibraryAST : public ExtAST
         std::string              _output;
         std::string              _extension;
         std::string              _buildName;
-
-        std::string codeGen() const;
+        std::vector<std::string> _unityExclude;
+        std::string              _pch;
+
+        void codeGen(Output &out) const;
+        void ninjaGen(Output &out) const;
+        bool compiles(std::vector<std::string> *sources,
+                      std::vector<std::string> *dependencies,
+                      std::vector<std::string> *unityExclude) const;
+        std::string target() const;
 };
 
-std::string LibraryAST::codeGen() const
+std::string LibraryAST::target() const
 {
-    std::string code;
+    return _name;
+}
+
+void LibraryAST::codeGen(Output &out) const
+{
+    if (MKParser::_backend == MKParser::Backend::NINJA) {
+        ninjaGen(out);
+        return;
+    }
 
     auto libName = "lib" + (_output.empty() ? _name : _output);
 
-    code = "lib_LTLIBRARIES += " + libName + ".la\n\n";
+    out << "lib_LTLIBRARIES += " << BlockAST::path(libName) << ".la\n\n";
+
+    libName = BlockAST::variable(libName);
+    out << libName << "_la_LDFLAGS = -avoid-version\n";
+
+    auto sources = _sources;
+    auto shared = BlockAST::sharedSources(this);
+    if (shared)
+        sources.erase(std::remove_if(sources.begin(), sources.end(),
+                                     [&](const std::string &source) {
+            return std::find(shared->sources.begin(), shared->sources.end(),
+                             source) != shared->sources.end();
+        }), sources.end());
+
+    std::vector<std::string> options;
+    auto groups = BlockAST::optionGroups(&sources, &options);
+    auto stem = (_output.empty() ? _name : _output) + "_la";
+
+    BlockAST::sourcesGen(out, libName + "_la",
+                         BlockAST::path("lib" + (_output.empty() ? _name
+                                                                 : _output)),
+                         sources, _unityExclude);
+
+    out << "\n\n";
+
+    std::vector<std::string> libraries;
+    for (size_t i = 0; i < groups.size(); ++i)
+        libraries.push_back(BlockAST::path("lib" + stem + "_opt"
+                                           + std::to_string(i + 1) + ".la"));
+
+    if (shared)
+        libraries.insert(libraries.end(), shared->libraries.begin(),
+                         shared->libraries.end());
+
+    std::vector<std::string> cxxFlags;
+    auto dependencies = BlockAST::reduceDependencies(libName + "_la_LIBADD",
+                                                     _dependencies);
+    if (!dependencies.empty() || !libraries.empty()) {
+        out << libName << "_la_LIBADD = \\\n  ";
+
+        if (!libraries.empty()) {
+            join(out, libraries, " \\\n  ");
+            if (!dependencies.empty())
+                out << " \\\n  ";
+        }
 
-    code += libName + "_la_LDFLAGS = -avoid-version\n";
+        BlockAST::dependenciesGen(out, dependencies, &cxxFlags);
 
-    code += libName + "_la_SOURCES = \\\n  ";
-    code += join(_sources, " \\\n  ");
+        out << "\n\n";
+    }
 
-    code += "\n\n";
-    if (!_dependencies.empty()) {
-        code += libName + "_la_LIBADD = \\\n  ";
-
-        std::vector<std::string> cxxFlags;
-        auto copyDependencies = _dependencies;
-        for (auto &dependency : copyDependencies) {
-            auto t = BlockAST::_libraryMap.find(dependency);
-            if (t != BlockAST::_libraryMap.end()) {
-                dependency = t->second.first;
-                if (!t->second.second.empty())
-                    cxxFlags.push_back(t->second.second);
-            }
-        }
+    if (dependencies.size() < _dependencies.size()) {
+        Buffer ignored;
+        cxxFlags.clear();
+        BlockAST::dependenciesGen(ignored, _dependencies, &cxxFlags);
+    }
 
-        code += join(copyDependencies, " \\\n  ");
-        code += "\n\n";
-        if (!cxxFlags.empty()) {
-            code += libName + "_la_CXXFLAGS = \\\n  ";
-            code += join(cxxFlags, " \\\n  ");
-            code += "\n\n";
-        }
+    auto flags = cxxFlags;
+    flags.push_back("-fPIC -DPIC");
+    /*
+     * The header is only compiled PIC, so the static objects are as well.
+     */
+    if (BlockAST::pchGen(out, libName + "_la",
+                         BlockAST::path("lib" + (_output.empty() ? _name
+                                                                 : _output)),
+                         sources, _pch, flags, &cxxFlags))
+        cxxFlags.push_back("-prefer-pic");
+    flags.pop_back();
+
+    BlockAST::ownOptionsGen(out, libName + "_la", options, &cxxFlags);
+
+    if (!cxxFlags.empty()) {
+        out << libName << "_la_CXXFLAGS = \\\n  ";
+        join(out, cxxFlags, " \\\n  ");
+        out << "\n\n";
     }
 
-    return code;
+    BlockAST::optionsGen(out, stem, groups, flags);
+}
+
+void LibraryAST::ninjaGen(Output &out) const
+{
+    std::vector<std::string> inputs, libs, cxxFlags = { "-fPIC" };
+    BlockAST::ninjaDependencies(_dependencies, &inputs, &libs, &cxxFlags);
+
+    auto objects = BlockAST::ninjaObjectsGen(out, "lib" + _name, _sources,
+                                             cxxFlags, &_unityExclude);
+
+    auto library = "$builddir/lib/lib" + (_output.empty() ? _name : _output)
+                   + (_extension.empty() ? ".so" : _extension);
+    BlockAST::ninjaLinkGen(out, "shlib", library, objects, inputs, libs,
+                           "$$ORIGIN");
+    BlockAST::buildGoal(library);
+}
+
+bool LibraryAST::compiles(std::vector<std::string> *sources,
+                          std::vector<std::string> *dependencies,
+                          std::vector<std::string> *unityExclude) const
+{
+    if (BlockAST::_pch && (!_pch.empty() || BlockAST::_inferPch))
+        return false;
+
+    *sources = _sources;
+    *dependencies = _dependencies;
+    *unityExclude = _unityExclude;
+    return true;
 }
 
 /*
@@ -789,12 +5129,29 @@ BlockAST::parseLibrary(const Attributes &attributes, const std::string &file,
     //      absolute or relative!!
     auto libPath = file.substr(0, file.find_last_of("/")) + "/" + "lib"
                                + args.at(0).at(0) + ".la";
+    if (MKParser::_backend == MKParser::Backend::NON_RECURSIVE ||
+        MKParser::_module)
+        libPath = path("lib" + args.at(0).at(0) + ".la");
+    else if (MKParser::_backend == MKParser::Backend::NINJA)
+        libPath = "$builddir/lib/lib" + (output.empty() ? args.at(0).at(0)
+                                                        : output)
+                  + (extension.empty() ? ".so" : extension);
 
     _libraryMap[args.at(0).at(0)].first = libPath;
+    if (MKParser::_entry)
+        MKParser::_entry->libraries.emplace_back(args.at(0).at(0), libPath);
+
+    registerTarget({ args.at(0).at(0), "library", file, args.at(1),
+                     args.at(2) });
 
     return std::make_shared<LibraryAST>(args.at(0).at(0), args.at(1),
                                         args.at(2), output, extension,
-                                        buildName);
+                                        buildName,
+                                        attribute(attributes,
+                                                  "UNITY_EXCLUDE"),
+                                        join(attribute(attributes,
+                                                       args.at(0).at(0)
+                                                       + "_PCH"), " "));
 }
 
 class NodeJsAddonAST : public ExtAST
@@ -815,37 +5172,58 @@ class NodeJsAddonAST : public ExtAST
         std::vector<std::string> _dependencies;
         std::vector<std::string> _otherJs;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        void ninjaGen(Output &out) const;
+        std::string target() const;
 };
 
-std::string NodeJsAddonAST::codeGen() const
+std::string NodeJsAddonAST::target() const
 {
-    std::string code;
+    return _name;
+}
+
+void NodeJsAddonAST::codeGen(Output &out) const
+{
+    if (MKParser::_backend == MKParser::Backend::NINJA) {
+        ninjaGen(out);
+        return;
+    }
 
-    auto libName = _name;
+    auto libName = BlockAST::variable(_name);
 
-    code = "noinst_LTLIBRARIES += " + libName + ".la\n\n";
-    code += libName + "_la_LDFLAGS = $(NODEJS_LIBTOOL_FLAGS)\n";
-    code += libName + "_la_CXXFLAGS = \n"; //TODO: FIXME!!
+    out << "noinst_LTLIBRARIES += " << BlockAST::path(_name) << ".la\n";
+    if (BlockAST::_addonList)
+        out << "NODEJS_ADDONS += " << BlockAST::path(_name) << ".la\n";
 
-    code += libName + "_la_SOURCES = \\\n  ";
-    code += join(_sources, " \\\n  ");
+    out << "NODEJS_NODE_FILES += " << BlockAST::path(".libs/" + _name)
+        << ".node\n";
 
-    if (!_dependencies.empty())
-        code += "\n\n" + libName + "_la_LIBADD = \\\n  ";
+    out << "\n" << libName << "_la_LDFLAGS = $(NODEJS_LIBTOOL_FLAGS)\n";
+    out << libName << "_la_CXXFLAGS = \n"; //TODO: FIXME!!
 
-    auto copyDependencies = _dependencies;
-    for (auto &dependency : copyDependencies) {
-        auto t = BlockAST::_libraryMap.find(dependency);
-        if (t != BlockAST::_libraryMap.end())
-            dependency = t->second.first;
-        else
-            std::cout << dependency << std::endl;
-    }
-    code += join(copyDependencies, " \\\n  ");
-    code += "\n\n";
+    out << libName << "_la_SOURCES = \\\n  ";
+    BlockAST::pathsGen(out, _sources);
+
+    auto dependencies = BlockAST::reduceDependencies(libName + "_la_LIBADD",
+                                                     _dependencies);
+    if (!dependencies.empty())
+        out << "\n\n" << libName << "_la_LIBADD = \\\n  ";
+
+    BlockAST::dependenciesGen(out, dependencies, nullptr);
+    out << "\n\n";
+}
+
+void NodeJsAddonAST::ninjaGen(Output &out) const
+{
+    std::vector<std::string> inputs, libs, cxxFlags = { "-fPIC" };
+    BlockAST::ninjaDependencies(_dependencies, &inputs, &libs, &cxxFlags);
+
+    auto objects = BlockAST::ninjaObjectsGen(out, _name, _sources, cxxFlags);
 
-    return code;
+    auto addon = "$builddir/lib/" + _name + ".node";
+    BlockAST::ninjaLinkGen(out, "shlib", addon, objects, inputs, libs,
+                           "$$ORIGIN");
+    BlockAST::buildGoal(addon);
 }
 
 /*
@@ -867,6 +5245,9 @@ BlockAST::parseNodeJsAddon(const Attributes &attributes,
     if (args.at(1).empty())
         throw Exception("Must pass at least 1 source file");
 
+    registerTarget({ args.at(0).at(0), "nodejs_addon", file, args.at(1),
+                     args.at(2) });
+
     return std::make_shared<NodeJsAddonAST>(args.at(0).at(0), args.at(1),
                                             args.at(2), args.at(3));
 }
@@ -891,12 +5272,24 @@ class NodeJsTestAST : public ExtAST
         std::string              _testName;
         std::vector<std::string> _testOptions;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        std::string target() const;
 };
 
-std::string NodeJsTestAST::codeGen() const
+std::string NodeJsTestAST::target() const
 {
-    return "";
+    return _name;
+}
+
+void NodeJsTestAST::codeGen(Output &out) const
+{
+    if (!BlockAST::_parallelTests)
+        return;
+
+    auto manual = std::find(_testOptions.begin(), _testOptions.end(),
+                            "manual") != _testOptions.end();
+    BlockAST::testGen(out, _name + ".js", "$(NODEJS)", _options, manual,
+                      _dependencies);
 }
 
 /*
@@ -920,6 +5313,9 @@ BlockAST::parseNodeJsTest(const Attributes &attributes,
 
     auto testName = args.at(3).empty() ? "" : args.at(3).at(0);
 
+    registerTarget({ args.at(0).at(0), "nodejs_test", file,
+                     { args.at(0).at(0) + ".js" }, args.at(1) });
+
     return std::make_shared<NodeJsTestAST>(args.at(0).at(0), args.at(1),
                                            args.at(2), testName, args.at(4));
 }
@@ -942,33 +5338,99 @@ class TestAST : public ExtAST
         std::vector<std::string> _style;
         std::vector<std::string> _targets;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        void ninjaGen(Output &out) const;
+        void harnessGen(Output &out) const;
+        std::string target() const;
 };
 
-std::string TestAST::codeGen() const
+std::string TestAST::target() const
 {
-    std::string code;
-    code += "TESTS += " + _name + "\n";
-    code += "check_PROGRAMS += " + _name + "\n";
-    code += _name + "_SOURCES = " + _name + ".cc\n";
-    code += _name + "_CXXFLAGS =\n"; //TODO: ADD FLAGS HERE
+    return _name;
+}
+
+void TestAST::codeGen(Output &out) const
+{
+    if (MKParser::_backend == MKParser::Backend::NINJA) {
+        ninjaGen(out);
+        return;
+    }
+
+    if (BlockAST::_parallelTests) {
+        harnessGen(out);
+        return;
+    }
+
+    auto name = BlockAST::variable(_name);
+
+    out << "TESTS += " << BlockAST::path(_name) << "\n";
+    out << "check_PROGRAMS += " << BlockAST::path(_name) << "\n";
+    out << name << "_SOURCES = " << BlockAST::path(_name) << ".cc\n";
+    out << name << "_CXXFLAGS =\n"; //TODO: ADD FLAGS HERE
 
     if (!_dependencies.empty()) {
-        code += _name + "_LADD = \\\n  ";
+        out << name << "_LADD = \\\n  ";
 
-        auto copyDependencies = _dependencies;
-        for (auto &dependency : copyDependencies) {
-            auto t = BlockAST::_libraryMap.find(dependency);
-            if (t != BlockAST::_libraryMap.end())
-                dependency = t->second.first;
-            else
-                std::cout << dependency << std::endl;
-        }
-        code += join(copyDependencies, " \\\n  ");
-        code += "\n\n";
+        BlockAST::dependenciesGen(out, _dependencies, nullptr);
+        out << "\n\n";
+    }
+}
+
+/*
+ * The test program, linked like a program, run under valgrind when its style
+ * asks for it.
+ */
+void TestAST::harnessGen(Output &out) const
+{
+    auto name = BlockAST::variable(_name);
+
+    out << "check_PROGRAMS += " << BlockAST::path(_name) << "\n";
+    out << name << "_SOURCES = " << BlockAST::path(_name) << ".cc\n";
+
+    std::vector<std::string> cxxFlags;
+    auto dependencies = BlockAST::reduceDependencies(name + "_LDADD",
+                                                     _dependencies);
+    if (!dependencies.empty()) {
+        out << name << "_LDADD = \\\n  ";
+        BlockAST::dependenciesGen(out, dependencies, &cxxFlags);
+        out << "\n";
+    }
+
+    if (dependencies.size() < _dependencies.size()) {
+        Buffer ignored;
+        cxxFlags.clear();
+        BlockAST::dependenciesGen(ignored, _dependencies, &cxxFlags);
+    }
+
+    if (!cxxFlags.empty()) {
+        out << name << "_CXXFLAGS = \\\n  ";
+        join(out, cxxFlags, " \\\n  ");
+        out << "\n";
     }
 
-    return code;
+    auto has = [this](const char *style) {
+        return std::find(_style.begin(), _style.end(), style) != _style.end();
+    };
+
+    BlockAST::testGen(out, _name,
+                      has("valgrind") ? "$(VALGRIND) $(VALGRIND_FLAGS)" : "",
+                      {}, has("manual"));
+}
+
+void TestAST::ninjaGen(Output &out) const
+{
+    std::vector<std::string> inputs, libs, cxxFlags;
+    BlockAST::ninjaDependencies(_dependencies, &inputs, &libs, &cxxFlags);
+
+    auto objects = BlockAST::ninjaObjectsGen(out, _name, { _name + ".cc" },
+                                             cxxFlags);
+
+    auto test = "$builddir/tests/" + BlockAST::path(_name);
+    BlockAST::ninjaLinkGen(out, "link", test, objects, inputs, libs,
+                           BlockAST::ninjaRpath("tests/"));
+
+    out << "build " << test << ".passed: test " << test << "\n\n";
+    BlockAST::checkGoal(test + ".passed");
 }
 
 /*
@@ -988,6 +5450,9 @@ BlockAST::parseTest(const Attributes &attributes, const std::string &file,
     if (args.at(0).size() != 1)
         throw Exception("Must have only 1 name");
 
+    registerTarget({ args.at(0).at(0), "test", file,
+                     { args.at(0).at(0) + ".cc" }, args.at(1) });
+
     return std::make_shared<TestAST>(args.at(0).at(0), args.at(1), args.at(2),
                                      args.at(3));
 }
@@ -1007,10 +5472,14 @@ class SubMakeAST : public ExtAST
         std::string _dir;
         std::string _makefile;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        bool independent() const;
+        void subMakes(std::vector<std::string> *files) const;
+
+        std::string file() const;
 };
 
-std::string SubMakeAST::codeGen() const
+std::string SubMakeAST::file() const
 {
     auto dir = (_dir.empty() ? _name : _dir);
 
@@ -1022,12 +5491,43 @@ std::string SubMakeAST::codeGen() const
         makefile  = (_makefile.empty() ? (_name + ".mk") : _makefile);
     }
 
-    auto file = _basedir + dir + "/" + makefile;
+    return _basedir + dir + "/" + makefile;
+}
+
+void SubMakeAST::codeGen(Output &out) const
+{
+    auto dir = (_dir.empty() ? _name : _dir);
+    auto file = this->file();
+    auto output = MKParser::output(_basedir + dir + "/");
+
+    if (MKParser::_entry)
+        MKParser::_entry->subMakes.emplace_back(file, output);
+
+    auto subtree = MKParser::runSubMake(file, output);
+    subtree.dir = dir;
+
+    if (MKParser::_backend == MKParser::Backend::NINJA) {
+        out << "subninja " << BlockAST::path(dir) << "/build.ninja\n";
+        BlockAST::buildGoal(BlockAST::path(dir) + "/all");
+        BlockAST::checkGoal(BlockAST::path(dir) + "/check");
+    }
+    else if (MKParser::_backend == MKParser::Backend::NON_RECURSIVE)
+        out << "include $(top_srcdir)/" << BlockAST::path(dir)
+            << "/Makefrag.am\n";
+    else if (MKParser::_subdirs)
+        MKParser::_subdirs->push_back(std::move(subtree));
+    else
+        out << "SUBDIRS += " << dir << "\n";
+}
 
-    MKParser parser(file);
-    parser.run(_basedir + dir + "/Makefile.am");
+bool SubMakeAST::independent() const
+{
+    return false;
+}
 
-    return "SUBDIRS += " + dir + "\n";
+void SubMakeAST::subMakes(std::vector<std::string> *files) const
+{
+    files->push_back(file());
 }
 
 /*
@@ -1058,15 +5558,30 @@ BlockAST::parseSubMake(const Attributes &attributes, const std::string &file,
                                         dir, makefile);
 }
 
-std::string SubMakesAST::codeGen() const
+const std::vector<std::string> &SubMakesAST::subDirs() const
+{
+    return _subDirs;
+}
+
+void SubMakesAST::codeGen(Output &out) const
 {
-    std::string code;
     for (auto &subDir : _subDirs) {
         SubMakeAST ast(subDir, _dir, "", "");
-        code += static_cast<ExtAST *>(&ast)->codeGen();
+        static_cast<ExtAST *>(&ast)->codeGen(out);
     }
+}
+
+bool SubMakesAST::independent() const
+{
+    return false;
+}
 
-    return code;
+void SubMakesAST::subMakes(std::vector<std::string> *files) const
+{
+    for (auto &subDir : _subDirs) {
+        SubMakeAST ast(subDir, _dir, "", "");
+        static_cast<ExtAST *>(&ast)->subMakes(files);
+    }
 }
 
 /*
@@ -1102,12 +5617,24 @@ class VOWSCoffeeTestAST : public ExtAST
         std::string              _target;
         std::vector<std::string> _testOptions;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        std::string target() const;
 };
 
-std::string VOWSCoffeeTestAST::codeGen() const
+std::string VOWSCoffeeTestAST::target() const
 {
-    return "";
+    return _name;
+}
+
+void VOWSCoffeeTestAST::codeGen(Output &out) const
+{
+    if (!BlockAST::_parallelTests)
+        return;
+
+    auto manual = std::find(_testOptions.begin(), _testOptions.end(),
+                            "manual") != _testOptions.end();
+    BlockAST::testGen(out, _name + ".coffee", "$(VOWS)", _options, manual,
+                      _dependencies);
 }
 
 /**
@@ -1132,6 +5659,9 @@ BlockAST::parseVOWSCoffeeTest(const Attributes &attributes,
 
     auto testName = args.at(3).empty() ? "" : args.at(3).at(0);
 
+    registerTarget({ args.at(0).at(0), "vowscoffee_test", file,
+                     { args.at(0).at(0) + ".coffee" }, args.at(1) });
+
     return std::make_shared<VOWSCoffeeTestAST>(args.at(0).at(0), args.at(1),
                                                args.at(2), testName,
                                                args.at(4));
@@ -1152,12 +5682,11 @@ class PythonProgramAST : public ExtAST
         std::vector<std::string> _sources;
         std::vector<std::string> _dependencies;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
 };
 
-std::string PythonProgramAST::codeGen() const
+void PythonProgramAST::codeGen(Output &) const
 {
-    return "";
 }
 
 /*
@@ -1199,12 +5728,24 @@ class VOWSJsTestAST : public ExtAST
         std::string              _target;
         std::vector<std::string> _testOptions;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        std::string target() const;
 };
 
-std::string VOWSJsTestAST::codeGen() const
+std::string VOWSJsTestAST::target() const
 {
-    return "";
+    return _name;
+}
+
+void VOWSJsTestAST::codeGen(Output &out) const
+{
+    if (!BlockAST::_parallelTests)
+        return;
+
+    auto manual = std::find(_testOptions.begin(), _testOptions.end(),
+                            "manual") != _testOptions.end();
+    BlockAST::testGen(out, _name + ".js", "$(VOWS)", _options, manual,
+                      _dependencies);
 }
 
 /*
@@ -1229,6 +5770,9 @@ BlockAST::parseVOWSJsTest(const Attributes &attributes,
 
     auto testName = args.at(3).empty() ? "" : args.at(3).at(0);
 
+    registerTarget({ args.at(0).at(0), "vowsjs_test", file,
+                     { args.at(0).at(0) + ".js" }, args.at(1) });
+
     return std::make_shared<VOWSJsTestAST>(args.at(0).at(0), args.at(1),
                                            args.at(2), testName,
                                            args.at(4));
@@ -1247,12 +5791,27 @@ class CompileOptionAST : public ExtAST
         std::vector<std::string> _fileNames;
         std::vector<std::string> _options;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        void
+        compileOptions(std::map<std::string,
+                                std::vector<std::string>> *options) const;
 };
 
-std::string CompileOptionAST::codeGen() const
+/*
+ * The options go to the targets compiling the files, see
+ * BlockAST::optionGroups().
+ */
+void CompileOptionAST::codeGen(Output &) const
+{
+}
+
+void CompileOptionAST::compileOptions(
+    std::map<std::string, std::vector<std::string>> *options) const
 {
-    return "";
+    for (const auto &fileName : _fileNames) {
+        auto &o = (*options)[fileName];
+        o.insert(o.end(), _options.begin(), _options.end());
+    }
 }
 
 /*
@@ -1280,12 +5839,11 @@ class AddSourcesAST : public ExtAST
     private:
         std::vector<std::string> _fileNames;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
 };
 
-std::string AddSourcesAST::codeGen() const
+void AddSourcesAST::codeGen(Output &) const
 {
-    return "";
 }
 
 /*
@@ -1320,12 +5878,11 @@ class PythonModuleAST : public ExtAST
         std::vector<std::string> _dependencies;
         std::vector<std::string> _libraries;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
 };
 
-std::string PythonModuleAST::codeGen() const
+void PythonModuleAST::codeGen(Output &) const
 {
-    return "";
 }
 
 /*
@@ -1366,12 +5923,20 @@ class PythonTestAST : public ExtAST
         std::vector<std::string> _dependencies;
         std::vector<std::string> _targets;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
 };
 
-std::string PythonTestAST::codeGen() const
+/*
+ * _dependencies holds the test options, see parsePythonTest().
+ */
+void PythonTestAST::codeGen(Output &out) const
 {
-    return "";
+    if (!BlockAST::_parallelTests)
+        return;
+
+    auto manual = std::find(_dependencies.begin(), _dependencies.end(),
+                            "manual") != _dependencies.end();
+    BlockAST::testGen(out, _name + ".py", "$(PYTHON)", {}, manual);
 }
 
 /*
@@ -1418,7 +5983,12 @@ class IfeqAST : public ExtAST
         bool        _isExpectedAttribute;
         BlockAST    _root;
 
-        std::string codeGen() const;
+        void codeGen(Output &out) const;
+        bool independent() const;
+        void subMakes(std::vector<std::string> *files) const;
+        void
+        compileOptions(std::map<std::string,
+                                std::vector<std::string>> *options) const;
 };
 
 std::unordered_map<std::string, std::string> IfeqAST::_ifSubstitute =
@@ -1432,24 +6002,72 @@ void IfeqAST::parse(std::deque<Token> *tokens)
     _root.parse(tokens);
 }
 
-std::string IfeqAST::codeGen() const
+/*
+ * ninja has no conditionals, so the blocks depending on configure (see
+ * _ifSubstitute) are left out of build.ninja.
+ */
+void IfeqAST::codeGen(Output &out) const
 {
-    std::string code;
+    if (_isCheckAttribute &&
+        MKParser::_backend == MKParser::Backend::NINJA) {
+        auto it = _ifSubstitute.find(_check);
+        if (it != _ifSubstitute.end())
+            out << "# skipped: needs " << it->second << "\n\n";
+    }
+    else if (_isCheckAttribute &&
+             MKParser::_backend == MKParser::Backend::MAKEFILE_IN) {
+        /*
+         * As automake does it: configure turns @HAVE_X_TRUE@ into # when X
+         * is false, commenting the block out.
+         */
+        Buffer block;
+        _root.codeGen(block);
+
+        auto it = _ifSubstitute.find(_check);
+        std::istringstream is(block.str());
+        std::string line;
+        while (std::getline(is, line)) {
+            if (it != _ifSubstitute.end() && !line.empty())
+                out << "@" << it->second << "_TRUE@";
+
+            out << line << "\n";
+        }
 
-    if (_isCheckAttribute) {
+        out << "\n";
+    }
+    else if (_isCheckAttribute) {
         auto it = _ifSubstitute.find(_check);
         if (it != _ifSubstitute.end())
-            code += "if " + it->second + "\n";
+            out << "if " << it->second << "\n";
 
-        code += _root.codeGen();
-        code += "endif\n\n";
+        _root.codeGen(out);
+        out << "endif\n\n";
     }
     else if (!_isExpectedAttribute) {
-        if (_check == _expected)
-            code += _root.codeGen() + "\n";
+        if (_check == _expected) {
+            _root.codeGen(out);
+            out << "\n";
+        }
     }
+}
 
-    return code;
+bool IfeqAST::independent() const
+{
+    return _root.independent();
+}
+
+void IfeqAST::subMakes(std::vector<std::string> *files) const
+{
+    if (_isCheckAttribute || (!_isExpectedAttribute && _check == _expected))
+        _root.subMakes(files);
+}
+
+void IfeqAST::compileOptions(std::map<std::string,
+                                      std::vector<std::string>> *options)
+    const
+{
+    if (_isCheckAttribute || (!_isExpectedAttribute && _check == _expected))
+        _root.compileOptions(options);
 }
 
 std::shared_ptr<ExtAST>
@@ -1625,6 +6243,10 @@ BlockAST::expandAttribute(const Attributes &attributes,
 
     tokens->pop_front();
     const auto v = attributes.find(variable);
+    if (_reads)
+        _reads->emplace_back(variable, v == attributes.end() ? 0 :
+                             hashString(join(v->second->value(), " ")));
+
     if (v != attributes.end()) {
         *result = v->second->value();
         return "";
@@ -1633,6 +6255,22 @@ BlockAST::expandAttribute(const Attributes &attributes,
     return variable;
 }
 
+/*
+ * The values of the attribute name, read the way expandAttribute() reads
+ * them.
+ */
+std::vector<std::string>
+BlockAST::attribute(const Attributes &attributes, const std::string &name)
+{
+    const auto v = attributes.find(name);
+    if (_reads)
+        _reads->emplace_back(name, v == attributes.end() ? 0 :
+                             hashString(join(v->second->value(), " ")));
+
+    return v == attributes.end() ? std::vector<std::string>()
+                                 : v->second->value();
+}
+
 std::vector<std::string>
 BlockAST::parseValues(const Attributes &attributes, const std::string &file,
                       std::deque<Token> *tokens)
@@ -1804,17 +6442,682 @@ BlockAST::parseFunction(std::deque<Token> *tokens) const
     return ret;
 }
 
+/*
+ * Keeps regenerating the tree as its .mk files are edited. Every pass goes
+ * through the manifest, so only the edited files and the outputs resolving
+ * libraries they define are parsed again; the include graph the manifest
+ * records is also what decides which files are watched.
+ */
+class Watcher
+{
+    public:
+        Watcher(const std::string &file,
+                const std::vector<std::string> &subdirs);
+        ~Watcher();
+
+        void run();
+    private:
+        static const int _debounce = 20;
+
+        std::string                          _file;
+        std::vector<std::string>             _subdirs;
+        int                                  _fd;
+        std::unordered_map<int, std::string> _dirs;
+        std::unordered_set<std::string>      _files;
+
+        void regenerate();
+        void update();
+        bool wait();
+};
+
+Watcher::Watcher(const std::string &file,
+                 const std::vector<std::string> &subdirs)
+    : _file(file), _subdirs(subdirs), _fd(inotify_init1(IN_CLOEXEC))
+{
+    if (_fd < 0)
+        throw Exception("Can't initialize inotify");
+}
+
+Watcher::~Watcher()
+{
+    close(_fd);
+}
+
+void Watcher::run()
+{
+    for (;;) {
+        regenerate();
+        update();
+
+        while (!wait());
+    }
+}
+
+void Watcher::regenerate()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    try {
+        MKParser::regenerate(_file, _subdirs);
+    } catch (_Exception &e) {
+        std::cout << e.what() << std::endl;
+    } catch (_Exception *e) {
+        std::cout << e->what() << std::endl;
+        delete e;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - start);
+
+    std::cout << MKParser::summary() << " (" << elapsed.count() << " ms)"
+              << std::endl;
+}
+
+/*
+ * Watches directories rather than files, editors usually save by renaming
+ * a new file over the old one.
+ */
+void Watcher::update()
+{
+    _files.clear();
+    _files.insert(_file);
+    for (const auto &entry : MKParser::_manifest->entries())
+        for (const auto &subMake : entry.second.subMakes)
+            _files.insert(subMake.first);
+
+    std::unordered_set<std::string> watched;
+    for (const auto &dir : _dirs)
+        watched.insert(dir.second);
+
+    for (const auto &file : _files) {
+        auto dir = file.substr(0, file.find_last_of("/"));
+        if (!watched.insert(dir).second)
+            continue;
+
+        auto wd = inotify_add_watch(_fd, dir.c_str(), IN_CLOSE_WRITE |
+                                    IN_MOVED_TO | IN_CREATE | IN_DELETE);
+        if (wd >= 0)
+            _dirs[wd] = dir;
+    }
+}
+
+/*
+ * Blocks until a watched file changes, then drains events until none came
+ * for _debounce ms so a burst of saves costs one pass.
+ */
+bool Watcher::wait()
+{
+    bool changed = false;
+    int timeout = -1;
+
+    for (;;) {
+        pollfd fd = { _fd, POLLIN, 0 };
+        auto ready = poll(&fd, 1, timeout);
+        if (ready < 0 && errno != EINTR)
+            throw Exception("Can't wait for inotify events");
+
+        if (ready <= 0)
+            return changed;
+
+        char buffer[4096]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        auto length = read(_fd, buffer, sizeof(buffer));
+        for (ssize_t i = 0; i < length;) {
+            auto event = reinterpret_cast<const inotify_event *>(buffer + i);
+            i += sizeof(inotify_event) + event->len;
+
+            auto dir = _dirs.find(event->wd);
+            if (dir == _dirs.end() || !event->len)
+                continue;
+
+            if (_files.count(dir->second + "/" + event->name)) {
+                changed = true;
+                timeout = _debounce;
+            }
+        }
+    }
+}
+
+/*
+ * Resident server on a unix socket. The manifest, the library registry and
+ * the target registry stay in memory between requests, so regenerating only
+ * parses what changed and queries don't parse anything. A request is a single
+ * line and gets "ok" or "error <reason>", then its payload, then EOF:
+ *
+ *   regenerate [DIR]   regenerate the tree, DIR even if it looks up to date
+ *   links TARGET       libraries TARGET links with, transitively
+ *   impacted FILE...   tests depending on the files, every test for a file
+ *                      no source is known to include, see
+ *                      BlockAST::impactedTests()
+ *   validate FILE      parse FILE without generating or registering anything
+ *   invalidate [DIR]   forget what is known about DIR, or about everything
+ *   shutdown
+ *
+ * Connections are served concurrently. links and impacted only read the
+ * parser state and run alongside each other, the other requests have it to
+ * themselves. A client has _timeout seconds to send its request, and run()
+ * returns once every connection has been served.
+ */
+class Server
+{
+    public:
+        Server(const std::string &socket, const std::string &file,
+               const std::vector<std::string> &subdirs);
+        ~Server();
+
+        void run();
+    private:
+        std::string              _socket;
+        std::string              _file;
+        std::vector<std::string> _subdirs;
+        int                      _fd;
+        pthread_rwlock_t         _lock;
+        std::atomic<bool>        _running;
+        std::mutex               _mutex;
+        std::condition_variable  _idle;
+        size_t                   _handlers = 0;
+
+        static const time_t _timeout = 10;
+
+        /*
+         * Holds _lock, shared or not, for a scope.
+         */
+        class Locked
+        {
+            public:
+                Locked(pthread_rwlock_t *lock, bool shared);
+                ~Locked();
+            private:
+                pthread_rwlock_t *_lock;
+        };
+
+        void handle(int fd);
+        std::string request(const std::string &line);
+
+        std::vector<std::string> links(const std::string &target) const;
+        static std::string output(std::string path);
+};
+
+Server::Server(const std::string &socket, const std::string &file,
+               const std::vector<std::string> &subdirs)
+    : _socket(socket), _file(file), _subdirs(subdirs),
+      _fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)), _running(true)
+{
+    pthread_rwlock_init(&_lock, nullptr);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (_fd < 0 || socket.size() >= sizeof(address.sun_path))
+        throw Exception("Can't create socket " + socket);
+
+    strcpy(address.sun_path, socket.c_str());
+    unlink(socket.c_str());
+
+    if (bind(_fd, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) < 0 || listen(_fd, 64) < 0)
+        throw Exception("Can't listen on " + socket);
+}
+
+Server::Locked::Locked(pthread_rwlock_t *lock, bool shared) : _lock(lock)
+{
+    if (shared)
+        pthread_rwlock_rdlock(_lock);
+    else
+        pthread_rwlock_wrlock(_lock);
+}
+
+Server::Locked::~Locked()
+{
+    pthread_rwlock_unlock(_lock);
+}
+
+Server::~Server()
+{
+    close(_fd);
+    unlink(_socket.c_str());
+    pthread_rwlock_destroy(&_lock);
+}
+
+void Server::run()
+{
+    {
+        Locked lock(&_lock, false);
+        MKParser::regenerate(_file, _subdirs);
+    }
+
+    while (_running) {
+        auto fd = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            break;
+        }
+
+        timeval timeout = { _timeout, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_handlers;
+        }
+
+        try {
+            std::thread(&Server::handle, this, fd).detach();
+        } catch (...) {
+            close(fd);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            --_handlers;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]() { return _handlers == 0; });
+}
+
+void Server::handle(int fd)
+{
+    std::string line;
+
+    char c;
+    while (line.size() < 4096 && read(fd, &c, 1) == 1 && c != '\n')
+        line += c;
+
+    auto response = request(line);
+    for (size_t sent = 0; sent < response.size();) {
+        auto count = send(fd, response.data() + sent,
+                          response.size() - sent, MSG_NOSIGNAL);
+        if (count <= 0)
+            break;
+
+        sent += count;
+    }
+
+    close(fd);
+
+    if (!_running)
+        shutdown(_fd, SHUT_RDWR);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_handlers == 0)
+        _idle.notify_all();
+}
+
+std::string Server::request(const std::string &line)
+{
+    std::istringstream fields(line);
+
+    std::string command, argument;
+    fields >> command >> argument;
+
+    Locked lock(&_lock, command == "links" || command == "impacted");
+    try {
+        if (command == "regenerate") {
+            if (!argument.empty())
+                MKParser::_manifest->erase(output(argument));
+
+            MKParser::regenerate(_file, _subdirs);
+            return "ok\n" + MKParser::summary() + "\n";
+        }
+
+        if (command == "links") {
+            if (!BlockAST::_targets.count(argument))
+                return "error Unknown target " + argument + "\n";
+
+            auto libraries = links(argument);
+            return "ok\n" + join(libraries, "\n")
+                   + (libraries.empty() ? "" : "\n");
+        }
+
+        if (command == "impacted") {
+            std::vector<std::string> files;
+            if (!argument.empty())
+                files.push_back(argument);
+
+            for (std::string file; fields >> file;)
+                files.push_back(file);
+
+            auto tests = BlockAST::impactedTests(MKParser::_top, files);
+            return "ok\n" + join(tests, "\n") + (tests.empty() ? "" : "\n");
+        }
+
+        if (command == "validate") {
+            MKParser parser(argument);
+            parser.validate();
+            return "ok\n";
+        }
+
+        if (command == "invalidate") {
+            if (argument.empty())
+                MKParser::_manifest->clear();
+            else
+                MKParser::_manifest->erase(output(argument));
+
+            return "ok\n";
+        }
+
+        if (command == "shutdown") {
+            _running = false;
+            return "ok\n";
+        }
+    } catch (_Exception &e) {
+        return std::string("error ") + e.what() + "\n";
+    } catch (_Exception *e) {
+        std::string reason = e->what();
+        delete e;
+        return "error " + reason + "\n";
+    }
+
+    return "error Unknown request " + command + "\n";
+}
+
+std::vector<std::string> Server::links(const std::string &target) const
+{
+    std::vector<std::string> libraries;
+    std::unordered_set<std::string> visited = { target };
+
+    std::function<void (const std::string &)> visit;
+    visit = [&](const std::string &name) {
+        auto t = BlockAST::_targets.find(name);
+        if (t == BlockAST::_targets.end())
+            return;
+
+        for (const auto &dependency : t->second.dependencies) {
+            if (!visited.insert(dependency).second)
+                continue;
+
+            auto library = BlockAST::_libraryMap.find(dependency);
+            libraries.push_back(library == BlockAST::_libraryMap.end() ?
+                                dependency : library->second.first);
+            visit(dependency);
+        }
+    };
+
+    visit(target);
+    return libraries;
+}
+
+std::string Server::output(std::string path)
+{
+    if (path.size() > 3 && path.compare(path.size() - 3, 3, ".mk") == 0)
+        path = path.substr(0, path.find_last_of("/"));
+
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+
+    return path + "/Makefile.am";
+}
+
+#ifdef MK_PARSER_GMK
+
+/*
+ * Built with -DMK_PARSER_GMK into mk_parser.so, GNU make 4 loads the
+ * parser with "load mk_parser.so". Its functions take the place of the
+ * make macros the .mk files call, $(call program,...) included, and
+ * $(eval $(call mk_parser_rules)) ends the Makefile, once every .mk is
+ * included.
+ */
+extern "C" {
+
+int plugin_is_GPL_compatible;
+
+static char *gmkExpand(const char *name, unsigned int argc, char **argv)
+{
+    std::string function = strcmp(name, "mk_parser_rules") ? name : "";
+
+    char *dir = gmk_expand("$(MK_DIR)");
+    std::string prefix = dir;
+    gmk_free(dir);
+
+    std::string code;
+    try {
+        code = MKParser::expand(function,
+                                std::vector<std::string>(argv, argv + argc),
+                                prefix);
+    } catch (_Exception &e) {
+        std::cerr << name << ": " << e.what() << std::endl;
+        gmk_eval("$(error mk_parser failed)", nullptr);
+    } catch (_Exception *e) {
+        std::cerr << name << ": " << e->what() << std::endl;
+        delete e;
+        gmk_eval("$(error mk_parser failed)", nullptr);
+    }
+
+    char *result = gmk_alloc(code.size() + 1);
+    memcpy(result, code.c_str(), code.size() + 1);
+    return result;
+}
+
+int mk_parser_gmk_setup(const gmk_floc *)
+{
+    static const std::vector<std::string> functions = BlockAST::functions();
+
+    MKParser::_backend = MKParser::Backend::MAKEFILE_IN;
+    MKParser::_module = true;
+
+    for (const auto &function : functions)
+        gmk_add_function(function.c_str(), gmkExpand, 0, 0,
+                         GMK_FUNC_DEFAULT);
+
+    gmk_add_function("mk_parser_rules", gmkExpand, 0, 0, GMK_FUNC_DEFAULT);
+    return 1;
+}
+
+}
+
+#else
+
+/*
+ * mk_parser [--manifest=FILE | --no-manifest] [--token-cache=DIR]
+ *           [--output-cache=DIR [--output-cache-size=MB] [--cache-stats]]
+ *           [--depfiles] [--batch-writes [--fsync]] [--jobs=N]
+ *           [--non-recursive | --ninja | --makefile-in] [--unity=N]
+ *           [--pch[=infer]] [--share-sources] [--subdir-deps]
+ *           [--roots=TARGET,... [--pruned-if=CONDITIONAL]] [--reduce-links]
+ *           [--parallel-tests[=SHARDS]]
+ *           [--watch | --daemon=SOCKET | --impacted-tests=FILE,...|-]
+ *           [FILE.mk [SUBDIR...]]
+ *
+ * --impacted-tests prints the tests depending on the given files (one per
+ * line on stdin with -), relative to the directory of FILE.mk, and exits. A
+ * file no target builds from, a header say, impacts the tests of the sources
+ * that included it at their last build, found in the .deps directories, or
+ * every test if none did. A tree that can't be read or parsed is an error.
+ *
+ * Errors go to stderr, with exit status 1.
+ */
 int main(int argc, char **argv)
 {
     std::string file("/Users/leobispo/workspace/rtbkit/rtbkit/rtbkit.mk");
+    std::vector<std::string> subdirs = { "googleurl", "tinyxml2", "leveldb",
+                                         "jml", "soa" };
+    std::string manifest;
+    std::string tokenCache;
+    std::string outputCache;
+    uint64_t outputCacheSize = 256;
+    bool useManifest = true;
+    bool cacheStats = false;
+    bool watch = false;
+    std::string daemon;
+    bool batchWrites = false;
+    bool sync = false;
+    bool impacted = false;
+    std::vector<std::string> changed;
+
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--no-manifest")
+            useManifest = false;
+        else if (arg.compare(0, 11, "--manifest=") == 0)
+            manifest = arg.substr(11);
+        else if (arg.compare(0, 14, "--token-cache=") == 0)
+            tokenCache = arg.substr(14);
+        else if (arg.compare(0, 15, "--output-cache=") == 0)
+            outputCache = arg.substr(15);
+        else if (arg.compare(0, 20, "--output-cache-size=") == 0)
+            outputCacheSize = std::stoull(arg.substr(20));
+        else if (arg == "--cache-stats")
+            cacheStats = true;
+        else if (arg == "--depfiles")
+            MKParser::_depfiles = true;
+        else if (arg == "--non-recursive")
+            MKParser::_backend = MKParser::Backend::NON_RECURSIVE;
+        else if (arg == "--ninja")
+            MKParser::_backend = MKParser::Backend::NINJA;
+        else if (arg == "--makefile-in")
+            MKParser::_backend = MKParser::Backend::MAKEFILE_IN;
+        else if (arg.compare(0, 8, "--unity=") == 0)
+            BlockAST::_unitySize = std::stoul(arg.substr(8));
+        else if (arg == "--pch")
+            BlockAST::_pch = true;
+        else if (arg == "--share-sources")
+            BlockAST::_shareSources = true;
+        else if (arg == "--subdir-deps")
+            MKParser::_orderSubdirs = true;
+        else if (arg == "--reduce-links")
+            BlockAST::_reduceLinks = true;
+        else if (arg == "--parallel-tests")
+            BlockAST::_parallelTests = true;
+        else if (arg.compare(0, 17, "--parallel-tests=") == 0) {
+            BlockAST::_parallelTests = true;
+            BlockAST::_testShards = std::stoul(arg.substr(17));
+        }
+        else if (arg.compare(0, 8, "--roots=") == 0) {
+            std::istringstream roots(arg.substr(8));
+            for (std::string root; std::getline(roots, root, ',');)
+                BlockAST::_roots.push_back(root);
+        }
+        else if (arg.compare(0, 12, "--pruned-if=") == 0)
+            BlockAST::_prunedIf = arg.substr(12);
+        else if (arg == "--pch=infer")
+            BlockAST::_pch = BlockAST::_inferPch = true;
+        else if (arg == "--batch-writes")
+            batchWrites = true;
+        else if (arg == "--fsync")
+            sync = true;
+        else if (arg.compare(0, 7, "--jobs=") == 0)
+            BlockAST::_jobs = std::stoul(arg.substr(7));
+        else if (arg == "--watch")
+            watch = true;
+        else if (arg.compare(0, 9, "--daemon=") == 0)
+            daemon = arg.substr(9);
+        else if (arg == "--impacted-tests=-") {
+            impacted = true;
+            for (std::string line; std::getline(std::cin, line);)
+                if (!line.empty())
+                    changed.push_back(line);
+        }
+        else if (arg.compare(0, 17, "--impacted-tests=") == 0) {
+            impacted = true;
+            std::istringstream files(arg.substr(17));
+            for (std::string changedFile; std::getline(files, changedFile, ',');)
+                changed.push_back(changedFile);
+        }
+        else
+            positional.push_back(arg);
+    }
+
+    /*
+     * build.ninja and Makefile.in run the tests with rules of their own.
+     */
+    if (MKParser::_backend == MKParser::Backend::NINJA ||
+        MKParser::_backend == MKParser::Backend::MAKEFILE_IN) {
+        BlockAST::_parallelTests = false;
+        BlockAST::_testShards = 0;
+    }
+
+    if (!positional.empty()) {
+        file = positional.at(0);
+        subdirs.assign(positional.begin() + 1, positional.end());
+    }
+
+    if (manifest.empty())
+        manifest = file.substr(0, file.find_last_of("/"))
+                   + "/.mk_parser.manifest";
+
     try {
-        MKParser parser(file, { "googleurl", "tinyxml2", "leveldb", "jml",
-                                "soa"});
+        if (BlockAST::_pch && MKParser::_backend == MKParser::Backend::NINJA)
+            throw Exception("--pch can't be used with --ninja");
+
+        if (useManifest) {
+            MKParser::_manifest = std::make_shared<Manifest>(manifest);
+            MKParser::_manifest->load();
+        }
+        else if (watch || !daemon.empty())
+            MKParser::_manifest = std::make_shared<Manifest>("");
+
+        if (watch || !daemon.empty())
+            MKParser::_statements = std::make_shared<
+                std::unordered_map<std::string,
+                                   std::vector<MKParser::Statement>>>();
+
+        if (!tokenCache.empty())
+            MKParser::_tokenCache = std::make_shared<TokenCache>(tokenCache);
+
+        if (!outputCache.empty())
+            MKParser::_outputCache = std::make_shared<OutputCache>(
+                outputCache, file.substr(0, file.find_last_of("/") + 1),
+                outputCacheSize << 20);
+
+        if (batchWrites)
+            MKParser::_writer = Writer::create(sync);
+
+        /*
+         * Nothing printed reads as no test impacted, so a tree that can't be
+         * read mustn't print nothing.
+         */
+        if (impacted) {
+            if (!std::ifstream(file))
+                throw Exception("Can't read " + file);
+
+            MKParser(file, subdirs).scan();
+            for (const auto &test : BlockAST::impactedTests(
+                     file.substr(0, file.find_last_of("/") + 1), changed))
+                std::cout << test << "\n";
+
+            return 0;
+        }
+
+        if (watch) {
+            Watcher watcher(file, subdirs);
+            watcher.run();
+        }
 
-        parser.run();
+        if (!daemon.empty()) {
+            Server server(daemon, file, subdirs);
+            server.run();
+            return 0;
+        }
+
+        MKParser::regenerate(file, subdirs);
+
+        std::cout << MKParser::summary() << std::endl;
+
+        if (MKParser::_outputCache) {
+            MKParser::_outputCache->evict();
+
+            if (cacheStats)
+                std::cerr << "output cache: "
+                          << MKParser::_outputCache->hits() << " hits, "
+                          << MKParser::_outputCache->misses() << " misses, "
+                          << MKParser::_outputCache->evictions()
+                          << " evicted" << std::endl;
+        }
     } catch (_Exception &e) {
-        std::cout << e.what() << std::endl;
+        std::cerr << e.what() << std::endl;
+        return 1;
+    } catch (_Exception *e) {
+        std::cerr << e->what() << std::endl;
+        delete e;
+        return 1;
     }
 
     return 0;
 }
+
+#endif
@@ -0,0 +1,9 @@
+LIBUTIL_SOURCES := \
+	util.cc \
+	strings.cc
+
+$(eval $(call library,util,$(LIBUTIL_SOURCES),boost_thread))
+$(eval $(call program,server,util,server.cc a/x.cc b/x.cc))
+$(eval $(call test,util_test,util,boost))
+
+$(eval $(call include_sub_make,tools))
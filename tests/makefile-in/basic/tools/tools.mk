@@ -0,0 +1 @@
+$(eval $(call program,dump,util,dump.cc))
@@ -0,0 +1,3 @@
+$(eval $(call library,hot,hot.cc cold.cc))
+$(eval $(call set_compile_option,hot.cc,-O3 -funroll-loops))
+$(eval $(call nodejs_addon,hot_js,hot_js.cc,hot))
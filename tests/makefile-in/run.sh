@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Generates the Makefile.in of every case of this directory again and diffs
+# them against the ones kept next to its .mk files, the top one being
+# CASE/CASE.mk. Paths into the case come out as @top_dir@.
+#
+#   run.sh [MK_PARSER]
+#
+# Without MK_PARSER, lexer.cpp is built first.
+
+here=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+mk_parser=$1
+if [ -z "$mk_parser" ]; then
+    mk_parser=$tmp/mk_parser
+    ${CXX:-g++} -std=c++11 -O1 -o "$mk_parser" "$here/../../lexer.cpp" \
+        -lpthread || exit 1
+fi
+
+status=0
+for dir in "$here"/*/; do
+    dir=${dir%/}
+    name=$(basename "$dir")
+    cp -R "$dir" "$tmp/$name"
+    find "$tmp/$name" -name Makefile.in -exec rm -f {} +
+
+    if ! "$mk_parser" --no-manifest --makefile-in "$tmp/$name/$name.mk" \
+         > /dev/null; then
+        echo "FAIL: $name"
+        status=1
+        continue
+    fi
+
+    failed=0
+    for expected in $(cd "$dir" && find . -name Makefile.in | sed 's|^\./||' | sort); do
+        sed "s|$tmp/$name/|@top_dir@/|g" "$tmp/$name/$expected" |
+            diff -u "$dir/$expected" - || failed=1
+    done
+
+    if [ $failed -eq 0 ]; then
+        echo "PASS: $name"
+    else
+        echo "FAIL: $name"
+        status=1
+    fi
+done
+
+exit $status